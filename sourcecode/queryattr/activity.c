@@ -0,0 +1,279 @@
+/*++
+
+Activity histograms: how many packets each service callback brings and how
+long after the one before it comes, for IOCTL_MOUFILTR_GET_HISTOGRAM.
+
+They only mean something while somebody reads the mouse, so they are not
+part of the device extension.  The first IRP_MJ_CREATE on a filter device
+allocates them and the last IRP_MJ_CLOSE frees them, which keeps an idle
+mouse (or a machine with many of them) down to the extension alone.  The
+service callback reads the pointer inside its grace period section like
+the other published pointers (see grace.c), so freeing never has to stop
+the packets.  The packets held back for coalescing (see coalesce.c) and
+the offload ring and thread (see offload.c) live here too, for the same
+reason.
+
+Those packets are older than anything the callback sees after the block
+is taken away, so until they have all been handed over, the callback
+drops new packets instead of sending them straight to the class driver
+(ActivityRetiring).  The mouse has just been closed, so there is nobody
+reading them anyway.
+
+File: activity.c
+
+--*/
+
+#include "moufiltr.h"
+
+PMOUFILTER_ACTIVITY
+MouFilter_ActivityAllocate (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+MouFilter_ActivityFree (
+    IN PMOUFILTER_ACTIVITY Activity
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_ActivityAllocate)
+#pragma alloc_text (PAGE, MouFilter_ActivityFree)
+#pragma alloc_text (PAGE, MouFilter_ActivityUpdate)
+#pragma alloc_text (PAGE, MouFilter_ActivityGet)
+#endif
+
+ULONG
+MouFilter_ActivityBucket(
+    IN ULONGLONG Value
+    )
+/*++
+Routine Description:
+
+    Bucket i counts values from 2^i up to 2^(i+1) - 1; 0 goes with 1, and
+    the last bucket takes everything too big for the others.
+
+--*/
+{
+    ULONG   bucket = 0;
+
+    while (Value > 1 && bucket < MOUFILTR_HISTOGRAM_BUCKETS - 1) {
+        Value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+VOID
+MouFilter_ActivityRecord(
+    IN PMOUFILTER_ACTIVITY Activity,
+    IN ULONG Packets,
+    IN ULONGLONG Now
+    )
+/*++
+Routine Description:
+
+    Counts one service callback.  Called at DISPATCH_LEVEL inside the grace
+    period section.  Like the stats, only ever written from the callback,
+    so no interlocked operations.
+
+--*/
+{
+    Activity->BatchSize[MouFilter_ActivityBucket(Packets)]++;
+
+    if (0 != Activity->LastCallback) {
+        Activity->Interval[MouFilter_ActivityBucket((Now - Activity->LastCallback) / 10)]++;
+    }
+
+    Activity->LastCallback = Now;
+}
+
+PMOUFILTER_ACTIVITY
+MouFilter_ActivityAllocate(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Sets up a new activity block, ready to be published.  Called at
+    PASSIVE_LEVEL.
+
+--*/
+{
+    PMOUFILTER_ACTIVITY activity;
+
+    PAGED_CODE();
+
+    activity = (PMOUFILTER_ACTIVITY) ExAllocatePool(NonPagedPool, sizeof(MOUFILTER_ACTIVITY));
+    if (NULL == activity) {
+        return NULL;
+    }
+
+    RtlZeroMemory(activity, sizeof(MOUFILTER_ACTIVITY));
+    MouFilter_CoalesceStart(&activity->Coalesce, DevExt);
+
+    //
+    // Without the thread the callback does the work itself, so a failure
+    // to start it is not a failure here
+    //
+    if (0 != (MouFilter_Config.Flags & MOUFILTER_CONFIG_OFFLOAD)) {
+        MouFilter_OffloadStart(&activity->Offload, DevExt);
+    }
+
+    return activity;
+}
+
+VOID
+MouFilter_ActivityFree(
+    IN PMOUFILTER_ACTIVITY Activity
+    )
+/*++
+Routine Description:
+
+    Frees an activity block that is not (or no longer) published, after
+    handing the packets it still holds to the class driver.  The offload
+    thread goes first, since it can still hand packets to the coalescing
+    code.
+
+--*/
+{
+    PAGED_CODE();
+
+    MouFilter_OffloadStop(&Activity->Offload);
+    MouFilter_CoalesceStop(&Activity->Coalesce);
+    ExFreePool(Activity);
+}
+
+VOID
+MouFilter_ActivityUpdate(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Allocates the histograms when the device is open and frees them when it
+    is not.  Called after every change to EnableCount, which itself changes
+    outside our locks.  Calls are serialized by ActivityLock and decide on
+    the count as it is then, so whichever call comes last leaves the right
+    state behind, and a new block is never published while the old one is
+    still handing over packets.
+
+--*/
+{
+    PMOUFILTER_ACTIVITY activity;
+    BOOLEAN             holdsPackets;
+
+    PAGED_CODE();
+
+    //
+    // A mutex rather than the publish lock: starting and stopping the
+    // offload thread takes PASSIVE_LEVEL
+    //
+    KeWaitForSingleObject(&DevExt->ActivityLock, Executive, KernelMode, FALSE, NULL);
+
+    if (0 < DevExt->EnableCount && NULL == DevExt->Activity) {
+        activity = MouFilter_ActivityAllocate(DevExt);
+        if (NULL != activity) {
+            ExAcquireFastMutex(&DevExt->PublishLock);
+            InterlockedExchangePointer((PVOID *) &DevExt->Activity, activity);
+            MouFilter_GraceWait(&DevExt->Grace);
+            ExReleaseFastMutex(&DevExt->PublishLock);
+
+            //
+            // No callback is still delivering the way it did without the
+            // block, so the offload thread can take over
+            //
+            MouFilter_OffloadGo(&activity->Offload);
+        }
+        else {
+            //
+            // Without the histograms the mouse works all the same, so
+            // running out of memory is only worth a message
+            //
+            DbgPrint("MouFilter_ActivityUpdate() no memory for the histograms\n");
+        }
+    }
+    else if (0 >= DevExt->EnableCount && NULL != DevExt->Activity) {
+        activity = DevExt->Activity;
+        holdsPackets = (BOOLEAN) (NULL != activity->Offload.Thread || 0 != MouFilter_Config.CoalesceTime);
+
+        ExAcquireFastMutex(&DevExt->PublishLock);
+
+        //
+        // Set before the block goes, so that no callback can go from
+        // handing packets to the block straight to the class driver
+        //
+        if (holdsPackets) {
+            InterlockedExchange(&DevExt->ActivityRetiring, 1);
+        }
+
+        InterlockedExchangePointer((PVOID *) &DevExt->Activity, NULL);
+        MouFilter_GraceWait(&DevExt->Grace);
+
+        ExReleaseFastMutex(&DevExt->PublishLock);
+
+        //
+        // Hands over whatever the block still holds, then lets the
+        // callback deliver again
+        //
+        MouFilter_ActivityFree(activity);
+
+        if (holdsPackets) {
+            InterlockedExchange(&DevExt->ActivityRetiring, 0);
+        }
+    }
+
+    KeReleaseMutex(&DevExt->ActivityLock, FALSE);
+}
+
+NTSTATUS
+MouFilter_ActivityGet(
+    IN ULONG InstanceId,
+    OUT PMOUFILTR_HISTOGRAM Histogram
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_MOUFILTR_GET_HISTOGRAM.  A device nobody has open reports
+    all zeroes.
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt;
+    PMOUFILTER_ACTIVITY activity;
+    NTSTATUS            status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Histogram, sizeof(MOUFILTR_HISTOGRAM));
+    Histogram->Version = MOUFILTR_INTERFACE_VERSION;
+    Histogram->Size = sizeof(MOUFILTR_HISTOGRAM);
+    Histogram->InstanceId = InstanceId;
+
+    MouFilter_AcquireGlobalLock();
+
+    devExt = MouFilter_FindDeviceLocked(InstanceId);
+    if (NULL == devExt) {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else {
+        //
+        // Holding the publish lock keeps the histograms from being freed
+        // while we copy them
+        //
+        ExAcquireFastMutex(&devExt->PublishLock);
+
+        activity = devExt->Activity;
+        if (NULL != activity) {
+            Histogram->Open = TRUE;
+            RtlCopyMemory(Histogram->BatchSize, activity->BatchSize, sizeof(Histogram->BatchSize));
+            RtlCopyMemory(Histogram->Interval, activity->Interval, sizeof(Histogram->Interval));
+        }
+
+        ExReleaseFastMutex(&devExt->PublishLock);
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    return status;
+}
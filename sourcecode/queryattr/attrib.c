@@ -0,0 +1,209 @@
+/*++
+
+The attribute cache: the last answer the lower drivers gave to
+IOCTL_MOUSE_QUERY_ATTRIBUTES, so that the class driver's queries can be
+completed right here instead of going down the stack every time.
+
+The cache is dropped, and the attributes asked for again in the
+background, whenever the port driver reports a packet with
+MOUSE_ATTRIBUTES_CHANGED set.  The asking is done by a work item: the
+port drivers handle internal device controls at PASSIVE_LEVEL, and the
+request must not go down the stack from inside the port driver's own
+callback.  Everything else in here can run at DISPATCH_LEVEL.
+
+File: attrib.c
+
+--*/
+
+#include "moufiltr.h"
+
+VOID
+MouFilter_AttributesWorkItem (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PVOID Context
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_AttributesInit)
+#pragma alloc_text (PAGE, MouFilter_AttributesWorkItem)
+#endif
+
+NTSTATUS
+MouFilter_AttributesInit(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Called from MouFilter_AddDevice.  The work item is freed when the
+    device is removed.
+
+--*/
+{
+    PAGED_CODE();
+
+    KeInitializeSpinLock(&DevExt->AttributesCache.Lock);
+    DevExt->AttributesCache.Valid = FALSE;
+    DevExt->AttributesCache.Generation = 0;
+
+    DevExt->AttributesCache.WorkItem = IoAllocateWorkItem(DevExt->Self);
+    if (NULL == DevExt->AttributesCache.WorkItem) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+MouFilter_AttributesInvalidate(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Forgets the cached attributes.  Returns the new generation; only an
+    answer to a query sent after this call may be stored under it.
+
+--*/
+{
+    PMOUFILTER_ATTRIBUTES_CACHE cache = &DevExt->AttributesCache;
+    KIRQL                       oldIrql;
+    ULONG                       generation;
+
+    KeAcquireSpinLock(&cache->Lock, &oldIrql);
+    cache->Valid = FALSE;
+    generation = ++cache->Generation;
+    KeReleaseSpinLock(&cache->Lock, oldIrql);
+
+    return generation;
+}
+
+BOOLEAN
+MouFilter_AttributesStore(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUSE_ATTRIBUTES Attributes,
+    IN ULONG Generation
+    )
+/*++
+Routine Description:
+
+    Caches Attributes unless the cache was invalidated again since
+    Generation was handed out, in which case the answer may be stale and
+    FALSE is returned.
+
+--*/
+{
+    PMOUFILTER_ATTRIBUTES_CACHE cache = &DevExt->AttributesCache;
+    KIRQL                       oldIrql;
+    BOOLEAN                     stored = FALSE;
+
+    KeAcquireSpinLock(&cache->Lock, &oldIrql);
+    if (Generation == cache->Generation) {
+        cache->Attributes = *Attributes;
+        cache->Valid = TRUE;
+        stored = TRUE;
+    }
+    KeReleaseSpinLock(&cache->Lock, oldIrql);
+
+    return stored;
+}
+
+BOOLEAN
+MouFilter_AttributesLookup(
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PMOUSE_ATTRIBUTES Attributes
+    )
+/*++
+Routine Description:
+
+    Copies the cached attributes to Attributes (which must be nonpaged).
+    Returns FALSE, and leaves Attributes alone, if there are none.
+
+--*/
+{
+    PMOUFILTER_ATTRIBUTES_CACHE cache = &DevExt->AttributesCache;
+    KIRQL                       oldIrql;
+    BOOLEAN                     valid;
+
+    KeAcquireSpinLock(&cache->Lock, &oldIrql);
+    valid = cache->Valid;
+    if (valid) {
+        *Attributes = cache->Attributes;
+    }
+    KeReleaseSpinLock(&cache->Lock, oldIrql);
+
+    return valid;
+}
+
+VOID
+MouFilter_AttributesRefresh(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Has the attributes asked for again, without waiting for the answer;
+    MouFilter_QueryMouseAttributes caches it.  Callable at any IRQL <=
+    DISPATCH_LEVEL.  At most one work item is queued at a time; asking
+    again while it is queued or running makes it query once more.
+
+--*/
+{
+    PMOUFILTER_ATTRIBUTES_CACHE cache = &DevExt->AttributesCache;
+
+    InterlockedExchange(&cache->RefreshPending, 1);
+
+    if (0 != InterlockedCompareExchange(&cache->RefreshQueued, 1, 0)) {
+        return;
+    }
+
+    //
+    // The work item holds a remove lock so that a remove cannot detach us
+    // while it is still talking to the stack
+    //
+    if (!NT_SUCCESS(IoAcquireRemoveLock(&DevExt->RemoveLock, cache))) {
+        InterlockedExchange(&cache->RefreshQueued, 0);
+        return;
+    }
+
+    IoQueueWorkItem(cache->WorkItem,
+                    MouFilter_AttributesWorkItem,
+                    DelayedWorkQueue,
+                    NULL);
+}
+
+VOID
+MouFilter_AttributesWorkItem(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PVOID Context
+    )
+{
+    PDEVICE_EXTENSION           devExt;
+    PMOUFILTER_ATTRIBUTES_CACHE cache;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    PAGED_CODE();
+
+    devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+    cache = &devExt->AttributesCache;
+
+    for (;;) {
+        while (0 != InterlockedExchange(&cache->RefreshPending, 0)) {
+            MouFilter_QueryMouseAttributes(devExt);
+        }
+
+        InterlockedExchange(&cache->RefreshQueued, 0);
+
+        //
+        // A refresh asked for after the last check but before RefreshQueued
+        // was cleared would not have queued us again; take it here
+        //
+        if (0 == cache->RefreshPending ||
+            0 != InterlockedCompareExchange(&cache->RefreshQueued, 1, 0)) {
+            break;
+        }
+    }
+
+    IoReleaseRemoveLock(&devExt->RemoveLock, cache);
+}
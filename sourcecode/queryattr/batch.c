@@ -0,0 +1,549 @@
+/*++
+
+Batched reads: user mode pends IOCTL_MOUFILTR_READ_BATCH requests on the
+control device, and the filter completes each one with a whole batch of
+packets instead of one packet per IRP.  The pending requests live in a
+cancel-safe queue (IoCsqXxx) per filter instance, so a program can exit or
+cancel its requests at any time without racing the service callback.
+
+File: batch.c
+
+--*/
+
+#include "moufiltr.h"
+
+VOID
+MouFilter_BatchKick (
+    IN PMOUFILTER_BATCH Batch,
+    IN BOOLEAN TimerExpired
+    );
+
+VOID
+MouFilter_BatchTimerDpc (
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    );
+
+NTSTATUS
+MouFilter_BatchCreate (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+//
+// Everything that runs in the service callback, the timer DPC or under the
+// batch spin lock has to stay in nonpaged code
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_BatchCreate)
+#pragma alloc_text (PAGE, MouFilter_BatchRead)
+#pragma alloc_text (PAGE, MouFilter_BatchCancelFile)
+#pragma alloc_text (PAGE, MouFilter_BatchDestroy)
+#endif
+
+C_ASSERT(0 == (MOUFILTER_BATCH_RECORDS & (MOUFILTER_BATCH_RECORDS - 1)));
+
+//
+// The pended IRP carries the system address and capacity of its output
+// buffer in DriverContext[0] and [1], and its own trigger in [2]: the
+// minimum count in the low 16 bits, the timeout in milliseconds above.
+// The cancel-safe queue uses [3].
+//
+#define BATCH_IRP_BUFFER(_Irp_)     ((PMOUFILTR_BATCH_HEADER) (_Irp_)->Tail.Overlay.DriverContext[0])
+#define BATCH_IRP_CAPACITY(_Irp_)   ((ULONG) (ULONG_PTR) (_Irp_)->Tail.Overlay.DriverContext[1])
+#define BATCH_IRP_MINIMUM(_Irp_)    ((ULONG) (ULONG_PTR) (_Irp_)->Tail.Overlay.DriverContext[2] & 0xFFFF)
+#define BATCH_IRP_TIMEOUT(_Irp_)    ((ULONG) (ULONG_PTR) (_Irp_)->Tail.Overlay.DriverContext[2] >> 16)
+
+#define BATCH_IRP_TRIGGER(_MinimumCount_, _TimeoutMs_) \
+    ((PVOID) (ULONG_PTR) (((_TimeoutMs_) << 16) | (_MinimumCount_)))
+
+C_ASSERT(MOUFILTER_BATCH_RECORDS <= 0xFFFF);
+C_ASSERT(MOUFILTR_BATCH_MAXIMUM_TIMEOUT <= 0xFFFF);
+
+//
+// Cancel-safe queue callbacks
+//
+
+VOID
+MouFilter_BatchCsqInsertIrp(
+    IN PIO_CSQ Csq,
+    IN PIRP Irp
+    )
+{
+    PMOUFILTER_BATCH batch = CONTAINING_RECORD(Csq, MOUFILTER_BATCH, Csq);
+
+    InsertTailList(&batch->PendingIrps, &Irp->Tail.Overlay.ListEntry);
+}
+
+VOID
+MouFilter_BatchCsqRemoveIrp(
+    IN PIO_CSQ Csq,
+    IN PIRP Irp
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+PIRP
+MouFilter_BatchCsqPeekNextIrp(
+    IN PIO_CSQ Csq,
+    IN PIRP Irp,
+    IN PVOID PeekContext
+    )
+/*++
+Routine Description:
+
+    PeekContext is NULL to take requests in order, or the file object whose
+    requests are being flushed at cleanup.
+
+--*/
+{
+    PMOUFILTER_BATCH    batch = CONTAINING_RECORD(Csq, MOUFILTER_BATCH, Csq);
+    PLIST_ENTRY         entry;
+    PIRP                nextIrp;
+
+    entry = (NULL == Irp) ? batch->PendingIrps.Flink : Irp->Tail.Overlay.ListEntry.Flink;
+
+    for ( ; entry != &batch->PendingIrps; entry = entry->Flink) {
+        nextIrp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+        if (NULL == PeekContext ||
+            IoGetCurrentIrpStackLocation(nextIrp)->FileObject == (PFILE_OBJECT) PeekContext) {
+            return nextIrp;
+        }
+    }
+
+    return NULL;
+}
+
+VOID
+MouFilter_BatchCsqAcquireLock(
+    IN PIO_CSQ Csq,
+    OUT PKIRQL Irql
+    )
+{
+    KeAcquireSpinLock(&CONTAINING_RECORD(Csq, MOUFILTER_BATCH, Csq)->Lock, Irql);
+}
+
+VOID
+MouFilter_BatchCsqReleaseLock(
+    IN PIO_CSQ Csq,
+    IN KIRQL Irql
+    )
+{
+    KeReleaseSpinLock(&CONTAINING_RECORD(Csq, MOUFILTER_BATCH, Csq)->Lock, Irql);
+}
+
+VOID
+MouFilter_BatchCsqCompleteCanceledIrp(
+    IN PIO_CSQ Csq,
+    IN PIRP Irp
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+VOID
+MouFilter_BatchAppend(
+    IN PMOUFILTER_BATCH Batch,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    )
+/*++
+Routine Description:
+
+    Called from MouFilter_ServiceCallback at DISPATCH_LEVEL.  Copies the
+    packets into the batch ring (dropping what does not fit), then lets
+    MouFilter_BatchKick decide whether a pending request can be completed.
+
+--*/
+{
+    PMOUSE_INPUT_DATA   pCursor;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    KeAcquireSpinLockAtDpcLevel(&Batch->Lock);
+
+    for (pCursor = InputDataStart; pCursor < InputDataEnd; pCursor++) {
+        if (Batch->Count == MOUFILTER_BATCH_RECORDS) {
+            Batch->Lost += (ULONG) (InputDataEnd - pCursor);
+            break;
+        }
+
+        Batch->Records[(Batch->First + Batch->Count) & (MOUFILTER_BATCH_RECORDS - 1)] = *pCursor;
+        Batch->Count++;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Batch->Lock);
+
+    MouFilter_BatchKick(Batch, FALSE);
+}
+
+ULONG
+MouFilter_BatchCopyLocked(
+    IN PMOUFILTER_BATCH Batch,
+    IN PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Moves as many waiting packets as fit into a request's output buffer.
+    The caller holds the batch lock.  Returns the number of packets moved.
+
+--*/
+{
+    PMOUFILTR_BATCH_HEADER  header = BATCH_IRP_BUFFER(Irp);
+    PMOUSE_INPUT_DATA       records = (PMOUSE_INPUT_DATA) (header + 1);
+    ULONG                   count;
+    ULONG                   chunk;
+
+    count = Batch->Count;
+    if (count > BATCH_IRP_CAPACITY(Irp)) {
+        count = BATCH_IRP_CAPACITY(Irp);
+    }
+
+    //
+    // At most two copies: up to the end of the ring, then from its start
+    //
+    chunk = MOUFILTER_BATCH_RECORDS - Batch->First;
+    if (chunk > count) {
+        chunk = count;
+    }
+
+    RtlCopyMemory(records, &Batch->Records[Batch->First], chunk * sizeof(MOUSE_INPUT_DATA));
+    RtlCopyMemory(records + chunk, &Batch->Records[0], (count - chunk) * sizeof(MOUSE_INPUT_DATA));
+
+    Batch->First = (Batch->First + count) & (MOUFILTER_BATCH_RECORDS - 1);
+    Batch->Count -= count;
+
+    header->Version = MOUFILTR_INTERFACE_VERSION;
+    header->Count = count;
+    header->Lost = Batch->Lost;
+    header->Reserved = 0;
+    Batch->Lost = 0;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof(MOUFILTR_BATCH_HEADER) + count * sizeof(MOUSE_INPUT_DATA);
+
+    return count;
+}
+
+VOID
+MouFilter_BatchKick(
+    IN PMOUFILTER_BATCH Batch,
+    IN BOOLEAN TimerExpired
+    )
+/*++
+Routine Description:
+
+    Completes pending requests for as long as there are enough packets
+    waiting for the request at the head of the queue (or, when the timer
+    went off, any packets at all), and otherwise makes sure the timer is
+    running, at that request's timeout, while packets wait.
+
+    Called at or below DISPATCH_LEVEL without the batch lock held, since
+    IoCsqRemoveNextIrp takes it too.
+
+--*/
+{
+    KIRQL           oldIrql;
+    PIRP            irp;
+    BOOLEAN         ready;
+    ULONG           copied;
+    LARGE_INTEGER   timeout;
+
+    for (;;) {
+        KeAcquireSpinLock(&Batch->Lock, &oldIrql);
+
+        if (TimerExpired) {
+            Batch->TimerArmed = FALSE;
+        }
+
+        if (IsListEmpty(&Batch->PendingIrps)) {
+            //
+            // Nobody is waiting; the packets keep until someone asks, and
+            // the next request kicks us again
+            //
+            KeReleaseSpinLock(&Batch->Lock, oldIrql);
+            return;
+        }
+
+        //
+        // The queue lock is the batch lock, so the head stays put (and
+        // uncancelled) while we look at its trigger
+        //
+        irp = CONTAINING_RECORD(Batch->PendingIrps.Flink, IRP, Tail.Overlay.ListEntry);
+
+        ready = (Batch->Count >= BATCH_IRP_MINIMUM(irp)) ||
+                (TimerExpired && 0 != Batch->Count);
+
+        if (!ready && 0 != Batch->Count && !Batch->TimerArmed) {
+            Batch->TimerArmed = TRUE;
+            timeout.QuadPart = -10000LL * BATCH_IRP_TIMEOUT(irp);
+            KeSetTimer(&Batch->Timer, timeout, &Batch->TimerDpc);
+        }
+
+        KeReleaseSpinLock(&Batch->Lock, oldIrql);
+
+        if (!ready) {
+            return;
+        }
+
+        irp = IoCsqRemoveNextIrp(&Batch->Csq, NULL);
+        if (NULL == irp) {
+            //
+            // Cancelled since we looked
+            //
+            return;
+        }
+
+        KeAcquireSpinLock(&Batch->Lock, &oldIrql);
+        copied = MouFilter_BatchCopyLocked(Batch, irp);
+        KeReleaseSpinLock(&Batch->Lock, oldIrql);
+
+        if (0 == copied) {
+            //
+            // Another processor got to the packets first; put the request
+            // back (it will be completed as cancelled if that happened
+            // in the meantime)
+            //
+            IoCsqInsertIrp(&Batch->Csq, irp, NULL);
+            return;
+        }
+
+        IoCompleteRequest(irp, IO_MOUSE_INCREMENT);
+
+        //
+        // Only the first request is owed the short timeout
+        //
+        TimerExpired = FALSE;
+    }
+}
+
+VOID
+MouFilter_BatchTimerDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    MouFilter_BatchKick((PMOUFILTER_BATCH) DeferredContext, TRUE);
+}
+
+NTSTATUS
+MouFilter_BatchCreate(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Allocates the batch state for a filter device the first time a batched
+    read is sent for it.  The caller holds the global lock.
+
+--*/
+{
+    PMOUFILTER_BATCH batch;
+
+    PAGED_CODE();
+
+    batch = (PMOUFILTER_BATCH) ExAllocatePool(NonPagedPool, sizeof(MOUFILTER_BATCH));
+    if (NULL == batch) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(batch, sizeof(MOUFILTER_BATCH));
+
+    KeInitializeSpinLock(&batch->Lock);
+    InitializeListHead(&batch->PendingIrps);
+    KeInitializeTimer(&batch->Timer);
+    KeInitializeDpc(&batch->TimerDpc, MouFilter_BatchTimerDpc, batch);
+
+    IoCsqInitialize(&batch->Csq,
+                    MouFilter_BatchCsqInsertIrp,
+                    MouFilter_BatchCsqRemoveIrp,
+                    MouFilter_BatchCsqPeekNextIrp,
+                    MouFilter_BatchCsqAcquireLock,
+                    MouFilter_BatchCsqReleaseLock,
+                    MouFilter_BatchCsqCompleteCanceledIrp);
+
+    //
+    // The service callback picks this up without taking any lock
+    //
+    InterlockedExchangePointer((PVOID *) &DevExt->Batch, batch);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MouFilter_BatchRead(
+    IN PIRP Irp,
+    IN PMOUFILTR_READ_BATCH_INPUT Input
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_MOUFILTR_READ_BATCH at PASSIVE_LEVEL: validates the output
+    buffer, queues the request on the instance it names, and completes it
+    right away if enough packets are already waiting.  Returns STATUS_PENDING
+    once the request belongs to the queue.
+
+--*/
+{
+    PDEVICE_EXTENSION       devExt;
+    PMOUFILTER_BATCH        batch = NULL;
+    PMOUFILTR_BATCH_HEADER  buffer;
+    ULONG                   capacity;
+    ULONG                   minimumCount;
+    ULONG                   timeoutMs;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    if (NULL == Irp->MdlAddress ||
+        MmGetMdlByteCount(Irp->MdlAddress) < sizeof(MOUFILTR_BATCH_HEADER) + sizeof(MOUSE_INPUT_DATA)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //
+    // Map the buffer now, while we are allowed to fail, so completing the
+    // request later is just a copy
+    //
+    buffer = (PMOUFILTR_BATCH_HEADER) MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (NULL == buffer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    capacity = (MmGetMdlByteCount(Irp->MdlAddress) - sizeof(MOUFILTR_BATCH_HEADER)) /
+               sizeof(MOUSE_INPUT_DATA);
+
+    minimumCount = Input->MinimumCount;
+    if (0 == minimumCount) {
+        minimumCount = MOUFILTR_BATCH_DEFAULT_MINIMUM;
+    }
+    if (minimumCount > capacity) {
+        minimumCount = capacity;
+    }
+    if (minimumCount > MOUFILTER_BATCH_RECORDS) {
+        minimumCount = MOUFILTER_BATCH_RECORDS;
+    }
+
+    timeoutMs = Input->TimeoutMs;
+    if (0 == timeoutMs) {
+        timeoutMs = MOUFILTR_BATCH_DEFAULT_TIMEOUT;
+    }
+    if (timeoutMs > MOUFILTR_BATCH_MAXIMUM_TIMEOUT) {
+        timeoutMs = MOUFILTR_BATCH_MAXIMUM_TIMEOUT;
+    }
+
+    Irp->Tail.Overlay.DriverContext[0] = buffer;
+    Irp->Tail.Overlay.DriverContext[1] = (PVOID) (ULONG_PTR) capacity;
+    Irp->Tail.Overlay.DriverContext[2] = BATCH_IRP_TRIGGER(minimumCount, timeoutMs);
+
+    //
+    // The global lock keeps the instance from being removed until the
+    // request is safely in its queue; removal empties the queue
+    //
+    MouFilter_AcquireGlobalLock();
+
+    devExt = MouFilter_FindDeviceLocked(Input->InstanceId);
+    if (NULL == devExt) {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else if (NULL == devExt->Batch) {
+        status = MouFilter_BatchCreate(devExt);
+    }
+
+    if (NT_SUCCESS(status)) {
+        batch = devExt->Batch;
+
+        IoCsqInsertIrp(&batch->Csq, Irp, NULL);
+        status = STATUS_PENDING;
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    if (STATUS_PENDING == status) {
+        MouFilter_BatchKick(batch, FALSE);
+    }
+
+    return status;
+}
+
+VOID
+MouFilter_BatchCancelFile(
+    IN PFILE_OBJECT FileObject
+    )
+/*++
+Routine Description:
+
+    Cancels every batched read sent through one handle, on every instance.
+    Called when the handle is cleaned up.
+
+--*/
+{
+    PLIST_ENTRY         entry;
+    PDEVICE_EXTENSION   devExt;
+    PIRP                irp;
+
+    PAGED_CODE();
+
+    MouFilter_AcquireGlobalLock();
+
+    for (entry = MouFilter_Globals.DeviceList.Flink;
+         entry != &MouFilter_Globals.DeviceList;
+         entry = entry->Flink) {
+
+        devExt = CONTAINING_RECORD(entry, DEVICE_EXTENSION, ListEntry);
+        if (NULL == devExt->Batch) {
+            continue;
+        }
+
+        while (NULL != (irp = IoCsqRemoveNextIrp(&devExt->Batch->Csq, FileObject))) {
+            MouFilter_BatchCsqCompleteCanceledIrp(&devExt->Batch->Csq, irp);
+        }
+    }
+
+    MouFilter_ReleaseGlobalLock();
+}
+
+VOID
+MouFilter_BatchDestroy(
+    IN PMOUFILTER_BATCH Batch
+    )
+/*++
+Routine Description:
+
+    Called when the filter device is removed and no more packets can
+    arrive.  Fails whatever is still pending and frees the batch.
+
+--*/
+{
+    PIRP irp;
+
+    PAGED_CODE();
+
+    //
+    // Make sure the timer DPC is neither queued nor still running
+    //
+    KeCancelTimer(&Batch->Timer);
+    KeFlushQueuedDpcs();
+
+    while (NULL != (irp = IoCsqRemoveNextIrp(&Batch->Csq, NULL))) {
+        irp->IoStatus.Status = STATUS_NO_SUCH_DEVICE;
+        irp->IoStatus.Information = 0;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+
+    ExFreePool(Batch);
+}
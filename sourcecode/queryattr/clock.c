@@ -0,0 +1,117 @@
+/*++
+
+Packet timestamps.  MOUSE_INPUT_DATA carries no time of its own, and the
+service callback only learns when a whole batch arrived, so the packets
+of a batch are spread out behind it at the mouse's polling interval.
+
+The clock is interrupt time: a read from memory the kernel shares with
+everyone, unlike KeQueryPerformanceCounter, which on many machines goes
+out to a timer chip.  It only moves once per clock tick, though, which is
+a long time at the rates these mice report at.  So each device also
+measures how far apart its packets come (counting how many arrive from
+one tick to the next) and carries its timestamps forward by that much
+while the tick stands still, never past where the next tick would be.
+The times it hands out never go backwards.
+
+The tick length is read once, in DriverEntry.  The time stamp counter
+would be cheaper still, but on the processors XP runs on it is neither
+kept in step between processors nor steady across power states.
+
+File: clock.c
+
+--*/
+
+#include "moufiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, MouFilter_ClockInit)
+#endif
+
+//
+// Longest clock tick, 100ns units
+//
+ULONG MouFilter_ClockResolution;
+
+VOID
+MouFilter_ClockInit(
+    VOID
+    )
+{
+    MouFilter_ClockResolution = KeQueryTimeIncrement();
+
+    DbgPrint("MouFilter_ClockInit() clock tick %lu.%04lu ms\n",
+             MouFilter_ClockResolution / 10000, MouFilter_ClockResolution % 10000);
+}
+
+ULONGLONG
+MouFilter_ClockBatch(
+    IN PMOUFILTER_CLOCK Clock,
+    IN ULONG Packets,
+    IN ULONGLONG Now,
+    OUT PULONG Spacing
+    )
+/*++
+Routine Description:
+
+    Works out the time of the last packet of a batch, and how far apart
+    the packets before it are (Spacing, 100ns units); packet i of n is at
+    the returned time less (n - 1 - i) * Spacing.  Called at DISPATCH_LEVEL
+    from the service callback, which is the only writer of Clock.
+
+--*/
+{
+    ULONGLONG   time;
+    ULONGLONG   sample;
+    ULONG       spacing;
+
+    //
+    // A new tick: the packets counted since the last one came in that long
+    //
+    if (Now != Clock->Tick) {
+        if (0 != Clock->Packets &&
+            0 != Clock->Tick &&
+            Now - Clock->Tick <= 2 * (ULONGLONG) MouFilter_ClockResolution) {
+
+            sample = (Now - Clock->Tick) / Clock->Packets;
+            if (sample > MOUFILTER_CLOCK_MAXIMUM_INTERVAL) {
+                sample = MOUFILTER_CLOCK_MAXIMUM_INTERVAL;
+            }
+
+            //
+            // Each sample moves the estimate an eighth of the way
+            //
+            Clock->Interval += ((LONG) (sample << MOUFILTER_CLOCK_SHIFT) - (LONG) Clock->Interval) / 8;
+        }
+
+        Clock->Tick = Now;
+        Clock->Packets = 0;
+    }
+
+    Clock->Packets += Packets;
+
+    spacing = (ULONG) Clock->Interval >> MOUFILTER_CLOCK_SHIFT;
+
+    //
+    // Where the packets would be if they kept coming at the same rate, but
+    // not before this tick (the mouse paused) or past the next one
+    //
+    time = Clock->Last + (ULONGLONG) Packets * spacing;
+    if (time < Now) {
+        time = Now;
+    }
+    else if (time > Now + MouFilter_ClockResolution) {
+        time = Now + MouFilter_ClockResolution;
+    }
+
+    //
+    // Squeeze the batch in after the last packet if it does not fit
+    //
+    if (0 != Packets && time - Clock->Last < (ULONGLONG) Packets * spacing) {
+        spacing = (ULONG) ((time - Clock->Last) / Packets);
+    }
+
+    Clock->Last = time;
+    *Spacing = spacing;
+
+    return time;
+}
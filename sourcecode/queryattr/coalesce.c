@@ -0,0 +1,295 @@
+/*++
+
+Coalescing: an optional mode for mice polled at several kHz, where the
+port driver calls us with one or two packets at a time and each call into
+the class driver costs more than the packets in it.  Packets that only
+move the mouse are held back and handed to the class driver together,
+once CoalesceCount of them have built up or the oldest has waited
+CoalesceTime microseconds (both from the registry, see config.c).  A
+packet with any button or wheel change, or anything but relative movement,
+sends everything held at once, so clicks are never delayed.
+
+While the mouse keeps moving, the next callback (a fraction of a
+millisecond later at these rates) is what notices that the oldest packet
+has waited long enough.  When it stops, a timer sends the last ones; the
+clock is asked to tick at CoalesceTime while the mouse is open, or the
+tail could wait for a whole default clock tick (10 to 15 ms).
+
+The held packets are part of the activity block (see activity.c), so they
+only take memory while the mouse is open.  A spin lock keeps the service
+callback and the timer DPC from handing packets over out of order, and
+the last of them are sent when the block goes away.
+
+File: coalesce.c
+
+--*/
+
+#include "moufiltr.h"
+
+VOID
+MouFilter_CoalesceFlush (
+    IN PMOUFILTER_COALESCE Coalesce
+    );
+
+VOID
+MouFilter_CoalesceTimerDpc (
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_CoalesceStart)
+#pragma alloc_text (PAGE, MouFilter_CoalesceStop)
+#endif
+
+VOID
+MouFilter_CoalesceDeliverLocked(
+    IN PMOUFILTER_COALESCE Coalesce,
+    IN PCONNECT_DATA Connection,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    )
+/*++
+Routine Description:
+
+    Hands packets to the class driver, or drops them if there is none.
+    Called at DISPATCH_LEVEL with the coalescing lock held, in a grace
+    period section (Connection stays valid until it ends).
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt = Coalesce->DevExt;
+    ULONG               consumed = 0;
+    ULONG               count;
+
+    count = (ULONG) (InputDataEnd - InputDataStart);
+    if (0 == count) {
+        return;
+    }
+
+    if (NULL != Connection) {
+        //
+        // The timer DPC, the offload thread and the callback all get here
+        //
+        InterlockedIncrement((PLONG) &devExt->Stats.ClassServiceCalls);
+
+        (*(PSERVICE_CALLBACK_ROUTINE) Connection->ClassService)(
+            Connection->ClassDeviceObject,
+            InputDataStart,
+            InputDataEnd,
+            &consumed
+            );
+    }
+
+    //
+    // We told the port driver these were consumed long ago, so whatever
+    // the class driver has no room for is lost.  The callback counts its
+    // own drops without the lock, hence the interlocked add.
+    //
+    if (consumed < count) {
+        InterlockedExchangeAdd((PLONG) &devExt->Stats.PacketsDropped, (LONG) (count - consumed));
+    }
+}
+
+VOID
+MouFilter_CoalesceReport(
+    IN PMOUFILTER_COALESCE Coalesce,
+    IN PCONNECT_DATA Connection,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Now
+    )
+/*++
+Routine Description:
+
+    Takes the packets of one service callback in place of the class
+    driver.  Called at DISPATCH_LEVEL inside the grace period section; the
+    caller reports every packet as consumed.
+
+--*/
+{
+    PMOUSE_INPUT_DATA   packet;
+    LARGE_INTEGER       dueTime;
+    ULONG               count;
+    BOOLEAN             flush = FALSE;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    count = (ULONG) (InputDataEnd - InputDataStart);
+
+    for (packet = InputDataStart; packet < InputDataEnd; packet++) {
+        if (0 != packet->ButtonFlags ||
+            0 != (packet->Flags & (MOUSE_MOVE_ABSOLUTE | MOUSE_ATTRIBUTES_CHANGED))) {
+            flush = TRUE;
+            break;
+        }
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&Coalesce->Lock);
+
+    //
+    // Whatever is held goes first, to keep the packets in order
+    //
+    if (Coalesce->Count + count > MOUFILTER_COALESCE_PACKETS) {
+        MouFilter_CoalesceDeliverLocked(Coalesce,
+                                        Connection,
+                                        Coalesce->Packets,
+                                        Coalesce->Packets + Coalesce->Count);
+        Coalesce->Count = 0;
+    }
+
+    if (count > MOUFILTER_COALESCE_PACKETS) {
+        //
+        // Already a big batch; nothing to gain by holding it
+        //
+        MouFilter_CoalesceDeliverLocked(Coalesce, Connection, InputDataStart, InputDataEnd);
+    }
+    else {
+        if (0 == Coalesce->Count) {
+            Coalesce->FirstTime = Now;
+        }
+
+        RtlCopyMemory(Coalesce->Packets + Coalesce->Count,
+                      InputDataStart,
+                      count * sizeof(MOUSE_INPUT_DATA));
+        Coalesce->Count += count;
+    }
+
+    if (flush ||
+        Coalesce->Count >= MouFilter_Config.CoalesceCount ||
+        Now - Coalesce->FirstTime >= (ULONGLONG) MouFilter_Config.CoalesceTime * 10) {
+
+        MouFilter_CoalesceDeliverLocked(Coalesce,
+                                        Connection,
+                                        Coalesce->Packets,
+                                        Coalesce->Packets + Coalesce->Count);
+        Coalesce->Count = 0;
+    }
+
+    if (0 != Coalesce->Count && !Coalesce->TimerArmed) {
+        //
+        // In case nothing else comes: send these once the oldest is due
+        //
+        Coalesce->TimerArmed = TRUE;
+        dueTime.QuadPart = -(LONGLONG) (Coalesce->FirstTime + MouFilter_Config.CoalesceTime * 10ULL - Now);
+        KeSetTimer(&Coalesce->Timer, dueTime, &Coalesce->TimerDpc);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Coalesce->Lock);
+}
+
+VOID
+MouFilter_CoalesceFlush(
+    IN PMOUFILTER_COALESCE Coalesce
+    )
+/*++
+Routine Description:
+
+    Hands everything held to the class driver.  Called at DISPATCH_LEVEL
+    from the timer DPC and when the activity block goes away.
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt = Coalesce->DevExt;
+    PCONNECT_DATA       connection;
+    ULONG               slot;
+
+    slot = MouFilter_GraceEnter(&devExt->Grace);
+    connection = devExt->UpperConnection;
+
+    KeAcquireSpinLockAtDpcLevel(&Coalesce->Lock);
+
+    Coalesce->TimerArmed = FALSE;
+
+    MouFilter_CoalesceDeliverLocked(Coalesce,
+                                    connection,
+                                    Coalesce->Packets,
+                                    Coalesce->Packets + Coalesce->Count);
+    Coalesce->Count = 0;
+
+    KeReleaseSpinLockFromDpcLevel(&Coalesce->Lock);
+
+    MouFilter_GraceLeave(&devExt->Grace, slot);
+}
+
+VOID
+MouFilter_CoalesceTimerDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    MouFilter_CoalesceFlush((PMOUFILTER_COALESCE) DeferredContext);
+}
+
+VOID
+MouFilter_CoalesceStart(
+    IN PMOUFILTER_COALESCE Coalesce,
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Sets up the coalescing part of a new activity block, before it is
+    published.  Every block that gets here also goes through
+    MouFilter_CoalesceStop, so the timer resolution requests pair up.
+
+--*/
+{
+    PAGED_CODE();
+
+    Coalesce->DevExt = DevExt;
+    KeInitializeSpinLock(&Coalesce->Lock);
+    KeInitializeTimer(&Coalesce->Timer);
+    KeInitializeDpc(&Coalesce->TimerDpc, MouFilter_CoalesceTimerDpc, Coalesce);
+
+    if (0 != MouFilter_Config.CoalesceTime) {
+        ExSetTimerResolution(MouFilter_Config.CoalesceTime * 10, TRUE);
+    }
+}
+
+VOID
+MouFilter_CoalesceStop(
+    IN PMOUFILTER_COALESCE Coalesce
+    )
+/*++
+Routine Description:
+
+    Called once the activity block is no longer published and the grace
+    period is over, so no callback can arm the timer again, and after the
+    offload thread has handed over its last packets.  Whatever is still
+    held goes to the class driver before the callback is let back on the
+    direct path (see activity.c), so nothing is sent out of order.
+
+--*/
+{
+    KIRQL   oldIrql;
+
+    PAGED_CODE();
+
+    if (0 == MouFilter_Config.CoalesceTime) {
+        return;
+    }
+
+    //
+    // Make sure the timer DPC is neither queued nor still running
+    //
+    KeCancelTimer(&Coalesce->Timer);
+    KeFlushQueuedDpcs();
+
+    //
+    // The class driver expects to be called at DISPATCH_LEVEL
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    MouFilter_CoalesceFlush(Coalesce);
+    KeLowerIrql(oldIrql);
+
+    ExSetTimerResolution(0, FALSE);
+}
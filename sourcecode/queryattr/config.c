@@ -0,0 +1,305 @@
+/*++
+
+Settings read from the Parameters subkey of the service key when the driver
+loads, so that a different scale or axis swap no longer takes a different
+build (see ..\invertaxis and ..\scalefast).  Every value is optional and a
+REG_DWORD:
+
+    TraceMask           categories of IRPs to print (MOUFILTER_TRACE_BIT);
+                        bit 4 prints every packet, and is off by default
+    CacheAttributes     0 sends every IOCTL_MOUSE_QUERY_ATTRIBUTES down the
+                        stack instead of answering it from the cache
+    AttributesTimeout   milliseconds to wait for the lower drivers to answer
+                        our own attribute queries
+    CoalesceTime        microseconds motion packets may be held back from
+                        the class driver while the mouse is open (see
+                        coalesce.c); 0, the default, sends them at once
+    CoalesceCount       packets held back before they are sent regardless
+    Offload             1 moves the transform and the call into the class
+                        driver out of the service callback into a thread
+                        (see offload.c)
+    SwapAxes            1 swaps X and Y
+    ScaleX, ScaleY      as in IOCTL_MOUFILTR_SET_TRANSFORM, MOUFILTR_SCALE_ONE
+                        (256) being 1.0; stored as a DWORD, so a negative
+                        scale (inverted axis) is 0xFFFFFF00 for -1.0
+    AccelThreshold      as in IOCTL_MOUFILTR_SET_TRANSFORM
+    AccelScale
+
+Everything is checked and worked out once, in DriverEntry, into
+MouFilter_Config, which is never written again.  Each new filter instance
+starts with the transform in it, unless a profile matches the mouse (see
+profile.c); IOCTL_MOUFILTR_SET_TRANSFORM can still change that at run
+time.  Nothing reads the registry after DriverEntry.
+
+File: config.c
+
+--*/
+
+#include "moufiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, MouFilter_ConfigLoad)
+#pragma alloc_text (INIT, MouFilter_ConfigQueryValue)
+#pragma alloc_text (INIT, MouFilter_ConfigReadTransform)
+#pragma alloc_text (PAGE, MouFilter_ConfigApply)
+#endif
+
+MOUFILTER_CONFIG MouFilter_Config;
+
+NTSTATUS
+MouFilter_ConfigQueryValue(
+    IN PWSTR ValueName,
+    IN ULONG ValueType,
+    IN PVOID ValueData,
+    IN ULONG ValueLength,
+    IN PVOID Context,
+    IN PVOID EntryContext
+    )
+/*++
+Routine Description:
+
+    Stores one REG_DWORD value for RtlQueryRegistryValues.
+    RTL_QUERY_REGISTRY_DIRECT would write a REG_SZ straight over the ULONG,
+    so the type is checked here; a value of the wrong type is ignored and
+    the default stays.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    if (REG_DWORD != ValueType || sizeof(ULONG) != ValueLength) {
+        DbgPrint("MouFilter_ConfigQueryValue() ignoring %ws, not a REG_DWORD\n", ValueName);
+        return STATUS_SUCCESS;
+    }
+
+    *(PULONG) EntryContext = *(PULONG) ValueData;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MouFilter_ConfigReadTransform(
+    IN ULONG RelativeTo,
+    IN PWSTR Path,
+    IN PWSTR Subkey OPTIONAL,
+    IN OUT PMOUFILTR_SET_TRANSFORM_INPUT Input
+    )
+/*++
+Routine Description:
+
+    Reads SwapAxes, ScaleX, ScaleY, AccelThreshold and AccelScale into
+    Input, for the Parameters key and for each profile (see profile.c).
+    Whatever is missing keeps the value Input came with.
+
+--*/
+{
+    RTL_QUERY_REGISTRY_TABLE    table[7];
+    PRTL_QUERY_REGISTRY_TABLE   entry = table;
+    ULONG                       swapAxes;
+    NTSTATUS                    status;
+
+    swapAxes = (Input->Flags & MOUFILTR_TRANSFORM_SWAP_AXES) ? 1 : 0;
+
+    RtlZeroMemory(table, sizeof(table));
+
+    if (NULL != Subkey) {
+        entry->Flags = RTL_QUERY_REGISTRY_SUBKEY;
+        entry->Name = Subkey;
+        entry++;
+    }
+
+    entry->QueryRoutine = MouFilter_ConfigQueryValue;
+    entry->Name = L"SwapAxes";
+    entry->EntryContext = &swapAxes;
+    entry++;
+
+    entry->QueryRoutine = MouFilter_ConfigQueryValue;
+    entry->Name = L"ScaleX";
+    entry->EntryContext = &Input->ScaleX;
+    entry++;
+
+    entry->QueryRoutine = MouFilter_ConfigQueryValue;
+    entry->Name = L"ScaleY";
+    entry->EntryContext = &Input->ScaleY;
+    entry++;
+
+    entry->QueryRoutine = MouFilter_ConfigQueryValue;
+    entry->Name = L"AccelThreshold";
+    entry->EntryContext = &Input->AccelThreshold;
+    entry++;
+
+    entry->QueryRoutine = MouFilter_ConfigQueryValue;
+    entry->Name = L"AccelScale";
+    entry->EntryContext = &Input->AccelScale;
+
+    //
+    // The entry after the last one stays zeroed and ends the table
+    //
+    status = RtlQueryRegistryValues(RelativeTo, Path, table, NULL, NULL);
+    if (!NT_SUCCESS(status) && STATUS_OBJECT_NAME_NOT_FOUND != status) {
+        DbgPrint("MouFilter_ConfigReadTransform() could not read the transform (0x%08x)\n", status);
+    }
+
+    Input->Flags &= ~MOUFILTR_TRANSFORM_SWAP_AXES;
+    if (0 != swapAxes) {
+        Input->Flags |= MOUFILTR_TRANSFORM_SWAP_AXES;
+    }
+}
+
+VOID
+MouFilter_ConfigLoad(
+    IN PUNICODE_STRING RegistryPath
+    )
+/*++
+Routine Description:
+
+    Called once from DriverEntry, before any device is added.  A missing
+    Parameters key, or a missing or bad value, leaves the built-in default.
+
+--*/
+{
+    RTL_QUERY_REGISTRY_TABLE        table[8];
+    MOUFILTR_SET_TRANSFORM_INPUT    input;
+    ULONG                           traceMask;
+    ULONG                           cacheAttributes = 1;
+    ULONG                           attributesTimeout = MOUFILTER_ATTRIBUTES_TIMEOUT;
+    ULONG                           coalesceTime = 0;
+    ULONG                           coalesceCount = MOUFILTER_COALESCE_COUNT;
+    ULONG                           offload = 0;
+    NTSTATUS                        status;
+
+    traceMask = MouFilter_TraceMask;
+
+    RtlZeroMemory(table, sizeof(table));
+
+    table[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    table[0].Name = L"Parameters";
+
+    table[1].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[1].Name = L"TraceMask";
+    table[1].EntryContext = &traceMask;
+
+    table[2].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[2].Name = L"CacheAttributes";
+    table[2].EntryContext = &cacheAttributes;
+
+    table[3].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[3].Name = L"AttributesTimeout";
+    table[3].EntryContext = &attributesTimeout;
+
+    table[4].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[4].Name = L"CoalesceTime";
+    table[4].EntryContext = &coalesceTime;
+
+    table[5].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[5].Name = L"CoalesceCount";
+    table[5].EntryContext = &coalesceCount;
+
+    table[6].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[6].Name = L"Offload";
+    table[6].EntryContext = &offload;
+
+    //
+    // table[7] stays zeroed and ends the table
+    //
+    status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE,
+                                    RegistryPath->Buffer,
+                                    table,
+                                    NULL,
+                                    NULL);
+
+    if (!NT_SUCCESS(status) && STATUS_OBJECT_NAME_NOT_FOUND != status) {
+        DbgPrint("MouFilter_ConfigLoad() could not read the parameters (0x%08x)\n", status);
+    }
+
+    MouFilter_TraceMask = traceMask;
+
+    MouFilter_Config.Flags = 0;
+    if (0 != cacheAttributes) {
+        MouFilter_Config.Flags |= MOUFILTER_CONFIG_CACHE_ATTRIBUTES;
+    }
+
+    if (0 != offload) {
+        MouFilter_Config.Flags |= MOUFILTER_CONFIG_OFFLOAD;
+    }
+
+    if (0 == attributesTimeout || attributesTimeout > MOUFILTER_ATTRIBUTES_MAXIMUM_TIMEOUT) {
+        DbgPrint("MouFilter_ConfigLoad() AttributesTimeout %lu out of range\n", attributesTimeout);
+        attributesTimeout = MOUFILTER_ATTRIBUTES_TIMEOUT;
+    }
+    MouFilter_Config.AttributesTimeout = attributesTimeout;
+
+    if (coalesceTime > MOUFILTER_COALESCE_MAXIMUM_TIME) {
+        DbgPrint("MouFilter_ConfigLoad() CoalesceTime %lu out of range\n", coalesceTime);
+        coalesceTime = 0;
+    }
+    MouFilter_Config.CoalesceTime = coalesceTime;
+
+    if (0 == coalesceCount || coalesceCount > MOUFILTER_COALESCE_PACKETS) {
+        DbgPrint("MouFilter_ConfigLoad() CoalesceCount %lu out of range\n", coalesceCount);
+        coalesceCount = MOUFILTER_COALESCE_COUNT;
+    }
+    MouFilter_Config.CoalesceCount = coalesceCount;
+
+    RtlZeroMemory(&input, sizeof(input));
+    input.Version = MOUFILTR_INTERFACE_VERSION;
+    input.ScaleX = MOUFILTR_SCALE_ONE;
+    input.ScaleY = MOUFILTR_SCALE_ONE;
+    input.AccelScale = MOUFILTR_SCALE_ONE;
+
+    MouFilter_ConfigReadTransform(RTL_REGISTRY_ABSOLUTE, RegistryPath->Buffer, L"Parameters", &input);
+
+    status = MouFilter_TransformCompile(&input, &MouFilter_Config.Transform);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_ConfigLoad() ignoring the transform, out of range\n");
+
+        input.Flags = 0;
+        input.ScaleX = MOUFILTR_SCALE_ONE;
+        input.ScaleY = MOUFILTR_SCALE_ONE;
+        input.AccelThreshold = 0;
+        MouFilter_TransformCompile(&input, &MouFilter_Config.Transform);
+    }
+    else if (!MouFilter_TransformIsIdentity(&MouFilter_Config.Transform)) {
+        MouFilter_Config.Flags |= MOUFILTER_CONFIG_TRANSFORM;
+    }
+
+    DbgPrint("MouFilter_ConfigLoad() flags 0x%x, attributes timeout %lu ms, coalescing %lu us/%lu, scale %ld/%ld\n",
+             MouFilter_Config.Flags, MouFilter_Config.AttributesTimeout,
+             MouFilter_Config.CoalesceTime, MouFilter_Config.CoalesceCount,
+             MouFilter_Config.Transform.ScaleX, MouFilter_Config.Transform.ScaleY);
+
+    MouFilter_ProfileLoad(RegistryPath);
+}
+
+NTSTATUS
+MouFilter_ConfigApply(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Gives a new filter instance the transform of the profile for its
+    hardware ID if there is one (see profile.c), and otherwise the one
+    in the Parameters key.  Called from MouFilter_AddDevice, before the
+    port driver can call us.
+
+--*/
+{
+    PMOUFILTER_PROFILE  profile;
+
+    PAGED_CODE();
+
+    profile = MouFilter_ProfileFindHardwareId(DevExt->PDO);
+    if (NULL != profile) {
+        DevExt->ProfileResolved = TRUE;
+        DbgPrint("MouFilter_ConfigApply() using the profile for %ws\n", profile->HardwareId);
+
+        return MouFilter_TransformPublishCopy(DevExt, &profile->Transform);
+    }
+
+    if (0 == (MouFilter_Config.Flags & MOUFILTER_CONFIG_TRANSFORM)) {
+        return STATUS_SUCCESS;
+    }
+
+    return MouFilter_TransformPublishCopy(DevExt, &MouFilter_Config.Transform);
+}
@@ -0,0 +1,87 @@
+/*++
+
+The connection to the class driver.  IOCTL_INTERNAL_MOUSE_CONNECT and
+IOCTL_INTERNAL_MOUSE_DISCONNECT replace the CONNECT_DATA the service
+callback reports to as a whole: a new copy is published with one pointer
+exchange, and the old one is freed after a grace period (see grace.c).
+
+The port driver is only hooked on the first connect.  After that it keeps
+reporting to us, and the class driver can disconnect and connect again
+(for instance when it is restarted) without the stack being rebuilt.
+
+File: connect.c
+
+--*/
+
+#include "moufiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_ConnectPublish)
+#endif
+
+NTSTATUS
+MouFilter_ConnectPublish(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PCONNECT_DATA ConnectData
+    )
+/*++
+Routine Description:
+
+    Makes the service callback report to ConnectData from now on, or drop
+    packets if ConnectData is NULL.  Returns once no service callback can
+    still be using the previous connection.
+
+--*/
+{
+    PCONNECT_DATA   connection = NULL;
+    PCONNECT_DATA   old;
+
+    PAGED_CODE();
+
+    if (NULL != ConnectData) {
+        connection = (PCONNECT_DATA) MouFilter_SnapshotAllocate();
+        if (NULL == connection) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        *connection = *ConnectData;
+    }
+
+    ExAcquireFastMutex(&DevExt->PublishLock);
+
+    old = InterlockedExchangePointer((PVOID *) &DevExt->UpperConnection,
+                                     connection);
+    if (NULL != old) {
+        MouFilter_GraceWait(&DevExt->Grace);
+    }
+
+    ExReleaseFastMutex(&DevExt->PublishLock);
+
+    if (NULL != old) {
+        MouFilter_SnapshotFree(old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MouFilter_ConnectComplete(
+    IN PDEVICE_OBJECT   DeviceObject,
+    IN PIRP             Irp,
+    IN PVOID            Context
+    )
+/*++
+Routine Description:
+
+    Completion routine of the first IOCTL_INTERNAL_MOUSE_CONNECT, which
+    hooked the port driver.  Hands the IRP back to MouFilter_InternIoCtl,
+    waiting on the event in Context, which only publishes the connection
+    if the port driver accepted it.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+
+    KeSetEvent((PKEVENT) Context, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
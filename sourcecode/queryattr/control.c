@@ -0,0 +1,679 @@
+/*++
+
+The control device: one named device object, shared by every instance of
+the filter, that user mode programs open to talk to the filter.  The filter
+devices themselves have no names and sit below mouclass, so nothing in user
+mode can reach them directly.
+
+The PnP manager will not unload a driver that still owns a device object,
+so the control device is created along with the first filter device and
+deleted along with the last one.  This is the same arrangement the DDK's
+toaster filter sample uses.
+
+File: control.c
+
+--*/
+
+#include <ntddk.h>
+#include <initguid.h>
+#include <wdmsec.h>
+#include "moufiltr.h"
+
+NTSTATUS
+MouFilter_CreateControlDevice (
+    IN PDRIVER_OBJECT Driver
+    );
+
+VOID
+MouFilter_DeleteControlDevice (
+    VOID
+    );
+
+NTSTATUS
+MouFilter_ControlDeviceControl (
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpStack,
+    OUT PULONG_PTR Information
+    );
+
+VOID
+MouFilter_ControlGetStatsLocked (
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PMOUFILTR_STATS Stats
+    );
+
+NTSTATUS
+MouFilter_ControlEnumInstances (
+    IN PIRP Irp,
+    OUT PULONG_PTR Information
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_RegisterDevice)
+#pragma alloc_text (PAGE, MouFilter_DeregisterDevice)
+#pragma alloc_text (PAGE, MouFilter_FindDeviceLocked)
+#pragma alloc_text (PAGE, MouFilter_AcquireGlobalLock)
+#pragma alloc_text (PAGE, MouFilter_ReleaseGlobalLock)
+#pragma alloc_text (PAGE, MouFilter_CreateControlDevice)
+#pragma alloc_text (PAGE, MouFilter_DeleteControlDevice)
+#pragma alloc_text (PAGE, MouFilter_ControlDispatch)
+#pragma alloc_text (PAGE, MouFilter_ControlDeviceControl)
+#pragma alloc_text (PAGE, MouFilter_ControlGetStatsLocked)
+#pragma alloc_text (PAGE, MouFilter_ControlEnumInstances)
+#endif
+
+VOID
+MouFilter_AcquireGlobalLock(
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    KeWaitForSingleObject(&MouFilter_Globals.Lock,
+                          Executive,
+                          KernelMode,
+                          FALSE,
+                          NULL);
+}
+
+VOID
+MouFilter_ReleaseGlobalLock(
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    KeReleaseMutex(&MouFilter_Globals.Lock, FALSE);
+}
+
+VOID
+MouFilter_RegisterDevice(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Called from AddDevice.  Gives the new filter device an instance number,
+    puts it on the global list, and brings up the control device if this is
+    the first filter device.  Failing to create the control device does not
+    fail the filter; it is tried again with the next AddDevice.
+
+--*/
+{
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    MouFilter_AcquireGlobalLock();
+
+    DevExt->InstanceId = MouFilter_Globals.NextInstanceId++;
+    InsertTailList(&MouFilter_Globals.DeviceList, &DevExt->ListEntry);
+    MouFilter_Globals.DeviceCount++;
+
+    if (NULL == MouFilter_Globals.ControlDeviceObject) {
+        status = MouFilter_CreateControlDevice(DevExt->Self->DriverObject);
+
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("MouFilter_RegisterDevice() could not create the control device (0x%08x)\n", status);
+        }
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    DbgPrint("MouFilter_RegisterDevice() added instance %lu\n", DevExt->InstanceId);
+}
+
+VOID
+MouFilter_DeregisterDevice(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Called while handling IRP_MN_REMOVE_DEVICE, after the lower drivers have
+    seen the remove (so no more packets will be reported to us).  Takes the
+    device off the global list, drops its reference on the packet tap, fails
+    any batched reads still pending on it, and deletes the control device
+    with the last filter device.
+
+--*/
+{
+    PMOUFILTER_TAP      tap;
+    PMOUFILTER_BATCH    batch;
+
+    PAGED_CODE();
+
+    MouFilter_AcquireGlobalLock();
+
+    RemoveEntryList(&DevExt->ListEntry);
+
+    tap = DevExt->Tap;
+    DevExt->Tap = NULL;
+
+    batch = DevExt->Batch;
+    DevExt->Batch = NULL;
+
+    ASSERT(0 < MouFilter_Globals.DeviceCount);
+    if (0 == --MouFilter_Globals.DeviceCount) {
+        MouFilter_DeleteControlDevice();
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    //
+    // User mode mappings hold their own references, so the shared pages
+    // stay around until the last consumer closes its handle
+    //
+    if (NULL != tap) {
+        MouFilter_TapRelease(tap);
+    }
+
+    if (NULL != batch) {
+        MouFilter_BatchDestroy(batch);
+    }
+}
+
+PDEVICE_EXTENSION
+MouFilter_FindDeviceLocked(
+    IN ULONG InstanceId
+    )
+/*++
+Routine Description:
+
+    Looks up a filter device by instance number.  The caller holds the
+    global lock, which keeps the device from being removed until it lets go.
+
+--*/
+{
+    PLIST_ENTRY         entry;
+    PDEVICE_EXTENSION   devExt;
+
+    PAGED_CODE();
+
+    for (entry = MouFilter_Globals.DeviceList.Flink;
+         entry != &MouFilter_Globals.DeviceList;
+         entry = entry->Flink) {
+
+        devExt = CONTAINING_RECORD(entry, DEVICE_EXTENSION, ListEntry);
+        if (devExt->InstanceId == InstanceId) {
+            return devExt;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+MouFilter_CreateControlDevice(
+    IN PDRIVER_OBJECT Driver
+    )
+{
+    UNICODE_STRING              ntName;
+    UNICODE_STRING              dosName;
+    PDEVICE_OBJECT              device;
+    PCONTROL_DEVICE_EXTENSION   ctlExt;
+    NTSTATUS                    status;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&ntName, MOUFILTR_CONTROL_DEVICE_NAME_U);
+    RtlInitUnicodeString(&dosName, MOUFILTR_DOS_DEVICE_NAME_U);
+
+    //
+    // Only the system and administrators may open the control device,
+    // since it hands out mappings of kernel memory
+    //
+    status = IoCreateDeviceSecure(Driver,
+                                  sizeof(CONTROL_DEVICE_EXTENSION),
+                                  &ntName,
+                                  FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN,
+                                  FALSE,
+                                  &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  (LPCGUID) &GUID_DEVCLASS_MOUFILTR_CONTROL,
+                                  &device
+                                  );
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = IoCreateSymbolicLink(&dosName, &ntName);
+    if (!NT_SUCCESS(status)) {
+        IoDeleteDevice(device);
+        return status;
+    }
+
+    ctlExt = (PCONTROL_DEVICE_EXTENSION) device->DeviceExtension;
+    RtlZeroMemory(ctlExt, sizeof(CONTROL_DEVICE_EXTENSION));
+    ctlExt->Type = MouFilterControlDevice;
+
+    device->Flags |= DO_BUFFERED_IO;
+    device->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    MouFilter_Globals.ControlDeviceObject = device;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MouFilter_DeleteControlDevice(
+    VOID
+    )
+{
+    UNICODE_STRING dosName;
+
+    PAGED_CODE();
+
+    if (NULL == MouFilter_Globals.ControlDeviceObject) {
+        return;
+    }
+
+    RtlInitUnicodeString(&dosName, MOUFILTR_DOS_DEVICE_NAME_U);
+    IoDeleteSymbolicLink(&dosName);
+
+    //
+    // Handles that are still open keep the object itself alive; they just
+    // can't find any filter instances any more
+    //
+    IoDeleteDevice(MouFilter_Globals.ControlDeviceObject);
+    MouFilter_Globals.ControlDeviceObject = NULL;
+}
+
+NTSTATUS
+MouFilter_ControlDispatch(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+/*++
+Routine Description:
+
+    Every IRP sent to the control device ends up here, whatever its major
+    function.  Nothing is passed down; the control device has no stack.
+
+--*/
+{
+    PIO_STACK_LOCATION      irpStack;
+    PMOUFILTER_FILE_CONTEXT fileContext;
+    ULONG_PTR               information = 0;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    irpStack = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (irpStack->MajorFunction) {
+    case IRP_MJ_CREATE:
+        fileContext = (PMOUFILTER_FILE_CONTEXT)
+            ExAllocatePool(PagedPool, sizeof(MOUFILTER_FILE_CONTEXT));
+
+        if (NULL == fileContext) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        InitializeListHead(&fileContext->Mappings);
+        irpStack->FileObject->FsContext = fileContext;
+        break;
+
+    case IRP_MJ_CLEANUP:
+        //
+        // Cleanup comes in the context of the process closing the last
+        // handle, which need not be the one that mapped the tap (handles
+        // can be duplicated or inherited); the unmap attaches to the
+        // owner where needed
+        //
+        MouFilter_TapUnmapAll((PMOUFILTER_FILE_CONTEXT) irpStack->FileObject->FsContext);
+        MouFilter_BatchCancelFile(irpStack->FileObject);
+        break;
+
+    case IRP_MJ_CLOSE:
+        fileContext = (PMOUFILTER_FILE_CONTEXT) irpStack->FileObject->FsContext;
+        ASSERT(IsListEmpty(&fileContext->Mappings));
+        ExFreePool(fileContext);
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        status = MouFilter_ControlDeviceControl(Irp, irpStack, &information);
+        if (STATUS_PENDING == status) {
+            //
+            // Queued; whoever takes it off the queue completes it
+            //
+            return status;
+        }
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = information;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+NTSTATUS
+MouFilter_ControlDeviceControl(
+    IN PIRP Irp,
+    IN PIO_STACK_LOCATION IrpStack,
+    OUT PULONG_PTR Information
+    )
+/*++
+Routine Description:
+
+    IRP_MJ_DEVICE_CONTROL on the control device.  The METHOD_BUFFERED codes
+    share Irp->AssociatedIrp.SystemBuffer between input and output, so
+    anything we need from the input is copied out before output is written.
+
+    Returns STATUS_PENDING, without completing the IRP, for a batched read
+    that has been queued.
+
+--*/
+{
+    PMOUFILTER_FILE_CONTEXT     fileContext;
+    PVOID                       buffer;
+    ULONG                       inLength;
+    ULONG                       outLength;
+    MOUFILTR_MAP_TAP_INPUT      mapInput;
+    MOUFILTR_MAP_TAP_OUTPUT     mapOutput;
+    MOUFILTR_UNMAP_TAP_INPUT    unmapInput;
+    MOUFILTR_READ_BATCH_INPUT   batchInput;
+    MOUFILTR_SET_TRANSFORM_INPUT transformInput;
+    MOUFILTR_INSTANCE_INPUT     instanceInput;
+    MOUFILTR_ENUM_INSTANCES_INPUT enumInput;
+    PDEVICE_EXTENSION           devExt;
+    NTSTATUS                    status;
+
+    PAGED_CODE();
+
+    fileContext = (PMOUFILTER_FILE_CONTEXT) IrpStack->FileObject->FsContext;
+    buffer = Irp->AssociatedIrp.SystemBuffer;
+    inLength = IrpStack->Parameters.DeviceIoControl.InputBufferLength;
+    outLength = IrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    switch (IrpStack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_MOUFILTR_MAP_TAP:
+        if (inLength < sizeof(MOUFILTR_MAP_TAP_INPUT) ||
+            outLength < sizeof(MOUFILTR_MAP_TAP_OUTPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        mapInput = *(PMOUFILTR_MAP_TAP_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != mapInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        RtlZeroMemory(&mapOutput, sizeof(MOUFILTR_MAP_TAP_OUTPUT));
+        status = MouFilter_TapMap(fileContext, &mapInput, Irp->RequestorMode, &mapOutput);
+
+        if (NT_SUCCESS(status)) {
+            *(PMOUFILTR_MAP_TAP_OUTPUT) buffer = mapOutput;
+            *Information = sizeof(MOUFILTR_MAP_TAP_OUTPUT);
+        }
+        break;
+
+    case IOCTL_MOUFILTR_UNMAP_TAP:
+        if (inLength < sizeof(MOUFILTR_UNMAP_TAP_INPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        unmapInput = *(PMOUFILTR_UNMAP_TAP_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != unmapInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_TapUnmap(fileContext, unmapInput.InstanceId);
+        break;
+
+    case IOCTL_MOUFILTR_READ_BATCH:
+        //
+        // METHOD_OUT_DIRECT: the input is still buffered, the output
+        // comes as Irp->MdlAddress
+        //
+        if (inLength < sizeof(MOUFILTR_READ_BATCH_INPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        batchInput = *(PMOUFILTR_READ_BATCH_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != batchInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_BatchRead(Irp, &batchInput);
+        break;
+
+    case IOCTL_MOUFILTR_SET_TRANSFORM:
+        if (inLength < sizeof(MOUFILTR_SET_TRANSFORM_INPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        transformInput = *(PMOUFILTR_SET_TRANSFORM_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != transformInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_TransformSet(&transformInput);
+        break;
+
+    case IOCTL_MOUFILTR_GET_TRANSFORM:
+        if (inLength < sizeof(MOUFILTR_INSTANCE_INPUT) ||
+            outLength < sizeof(MOUFILTR_SET_TRANSFORM_INPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        instanceInput = *(PMOUFILTR_INSTANCE_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != instanceInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_TransformGet(instanceInput.InstanceId,
+                                        (PMOUFILTR_SET_TRANSFORM_INPUT) buffer);
+        if (NT_SUCCESS(status)) {
+            *Information = sizeof(MOUFILTR_SET_TRANSFORM_INPUT);
+        }
+        break;
+
+    case IOCTL_MOUFILTR_GET_HISTOGRAM:
+        if (inLength < sizeof(MOUFILTR_INSTANCE_INPUT) ||
+            outLength < sizeof(MOUFILTR_HISTOGRAM)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        instanceInput = *(PMOUFILTR_INSTANCE_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != instanceInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_ActivityGet(instanceInput.InstanceId,
+                                       (PMOUFILTR_HISTOGRAM) buffer);
+        if (NT_SUCCESS(status)) {
+            *Information = sizeof(MOUFILTR_HISTOGRAM);
+        }
+        break;
+
+    case IOCTL_MOUFILTR_GET_STATS:
+        if (inLength < sizeof(MOUFILTR_INSTANCE_INPUT) ||
+            outLength < sizeof(MOUFILTR_STATS)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        instanceInput = *(PMOUFILTR_INSTANCE_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != instanceInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        MouFilter_AcquireGlobalLock();
+
+        devExt = MouFilter_FindDeviceLocked(instanceInput.InstanceId);
+        if (NULL == devExt) {
+            status = STATUS_NO_SUCH_DEVICE;
+        }
+        else {
+            MouFilter_ControlGetStatsLocked(devExt, (PMOUFILTR_STATS) buffer);
+            *Information = sizeof(MOUFILTR_STATS);
+            status = STATUS_SUCCESS;
+        }
+
+        MouFilter_ReleaseGlobalLock();
+        break;
+
+    case IOCTL_MOUFILTR_ENUM_INSTANCES:
+        //
+        // METHOD_OUT_DIRECT, since the list grows with the number of mice
+        //
+        if (inLength < sizeof(MOUFILTR_ENUM_INSTANCES_INPUT)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        enumInput = *(PMOUFILTR_ENUM_INSTANCES_INPUT) buffer;
+        if (MOUFILTR_INTERFACE_VERSION != enumInput.Version) {
+            status = STATUS_REVISION_MISMATCH;
+            break;
+        }
+
+        status = MouFilter_ControlEnumInstances(Irp, Information);
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    return status;
+}
+
+VOID
+MouFilter_ControlGetStatsLocked(
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PMOUFILTR_STATS Stats
+    )
+/*++
+Routine Description:
+
+    Copies the counters of a filter device, gathered from the groups of
+    the device extension that keep them.  The service callback keeps
+    counting meanwhile, so the copy is a snapshot of each counter, not of
+    all of them at one instant.
+
+--*/
+{
+    PAGED_CODE();
+
+    RtlZeroMemory(Stats, sizeof(MOUFILTR_STATS));
+
+    Stats->Version = MOUFILTR_INTERFACE_VERSION;
+    Stats->Size = sizeof(MOUFILTR_STATS);
+
+    Stats->Callbacks = DevExt->Stats.Callbacks;
+    Stats->Packets = DevExt->Stats.Packets;
+    Stats->PacketsDropped = DevExt->Stats.PacketsDropped;
+    Stats->ClassServiceCalls = DevExt->Stats.ClassServiceCalls;
+    Stats->PacketInterval = (ULONG) DevExt->Clock.Interval >> MOUFILTER_CLOCK_SHIFT;
+
+    Stats->AttributeQueriesCached = DevExt->IoctlStats.AttributeQueriesCached;
+    Stats->AttributeQueriesForwarded = DevExt->IoctlStats.AttributeQueriesForwarded;
+    Stats->Connects = DevExt->IoctlStats.Connects;
+    Stats->Disconnects = DevExt->IoctlStats.Disconnects;
+}
+
+NTSTATUS
+MouFilter_ControlEnumInstances(
+    IN PIRP Irp,
+    OUT PULONG_PTR Information
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_MOUFILTR_ENUM_INSTANCES: fills the caller's buffer with as
+    many filter instances as fit.
+
+--*/
+{
+    PMOUFILTR_INSTANCE_LIST list;
+    PMOUFILTR_INSTANCE_INFO info;
+    PLIST_ENTRY             entry;
+    PDEVICE_EXTENSION       devExt;
+    ULONG                   capacity;
+
+    PAGED_CODE();
+
+    if (NULL == Irp->MdlAddress ||
+        MmGetMdlByteCount(Irp->MdlAddress) < sizeof(MOUFILTR_INSTANCE_LIST)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    list = (PMOUFILTR_INSTANCE_LIST) MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (NULL == list) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    capacity = (MmGetMdlByteCount(Irp->MdlAddress) - sizeof(MOUFILTR_INSTANCE_LIST)) /
+               sizeof(MOUFILTR_INSTANCE_INFO);
+
+    RtlZeroMemory(list, sizeof(MOUFILTR_INSTANCE_LIST));
+    list->Version = MOUFILTR_INTERFACE_VERSION;
+    info = (PMOUFILTR_INSTANCE_INFO) (list + 1);
+
+    MouFilter_AcquireGlobalLock();
+
+    list->Count = MouFilter_Globals.DeviceCount;
+
+    for (entry = MouFilter_Globals.DeviceList.Flink;
+         entry != &MouFilter_Globals.DeviceList && list->Returned < capacity;
+         entry = entry->Flink) {
+
+        devExt = CONTAINING_RECORD(entry, DEVICE_EXTENSION, ListEntry);
+
+        info->InstanceId = devExt->InstanceId;
+        info->Flags = 0;
+        if (devExt->Started) {
+            info->Flags |= MOUFILTR_INSTANCE_STARTED;
+        }
+        if (NULL != devExt->UpperConnection) {
+            info->Flags |= MOUFILTR_INSTANCE_CONNECTED;
+        }
+        if (NULL != devExt->Tap) {
+            info->Flags |= MOUFILTR_INSTANCE_TAPPED;
+        }
+        if (NULL != devExt->Batch) {
+            info->Flags |= MOUFILTR_INSTANCE_BATCHING;
+        }
+        if (NULL != devExt->Transform) {
+            info->Flags |= MOUFILTR_INSTANCE_TRANSFORMED;
+        }
+        if (NULL != devExt->Activity) {
+            info->Flags |= MOUFILTR_INSTANCE_OPEN;
+        }
+        MouFilter_ControlGetStatsLocked(devExt, &info->Stats);
+
+        info++;
+        list->Returned++;
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    *Information = sizeof(MOUFILTR_INSTANCE_LIST) +
+                   list->Returned * sizeof(MOUFILTR_INSTANCE_INFO);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,124 @@
+/*++
+
+Grace periods for the pointers MouFilter_ServiceCallback reads without a
+lock.  A writer publishes a new snapshot with one pointer exchange and then
+calls MouFilter_GraceWait before freeing the old one; the callback brackets
+its reads with MouFilter_GraceEnter and MouFilter_GraceLeave.
+
+Readers count themselves in one of two counters, picked by the low bit of
+the epoch.  The writer flips the epoch and waits for the counter it flipped
+away from to drain, then does the same for the other one.  New readers
+always land in the counter that is not being waited on, so the wait cannot
+be starved by a steady stream of packets, and after both flips nobody can
+still hold a pointer read before the exchange.
+
+File: grace.c
+
+--*/
+
+#include "moufiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_GraceWait)
+#pragma alloc_text (PAGE, MouFilter_SnapshotAllocate)
+#pragma alloc_text (PAGE, MouFilter_SnapshotFree)
+#endif
+
+ULONG
+MouFilter_GraceEnter(
+    IN PMOUFILTER_GRACE Grace
+    )
+/*++
+Routine Description:
+
+    Starts a read-side section.  Returns the slot to hand to
+    MouFilter_GraceLeave.  Callable at any IRQL <= DISPATCH_LEVEL.
+
+--*/
+{
+    ULONG   slot;
+
+    slot = (ULONG) Grace->Epoch & 1;
+    InterlockedIncrement(&Grace->Readers[slot]);
+
+    return slot;
+}
+
+VOID
+MouFilter_GraceLeave(
+    IN PMOUFILTER_GRACE Grace,
+    IN ULONG Slot
+    )
+{
+    InterlockedDecrement(&Grace->Readers[Slot]);
+}
+
+VOID
+MouFilter_GraceWait(
+    IN PMOUFILTER_GRACE Grace
+    )
+/*++
+Routine Description:
+
+    Returns once every read-side section that started before the call has
+    ended.  Writers must be serialized by the caller.  Called at
+    IRQL < DISPATCH_LEVEL; read-side sections only ever run for the length
+    of one service callback, so polling once a millisecond is plenty.
+
+--*/
+{
+    LARGE_INTEGER   interval;
+    LONG            epoch;
+    ULONG           pass;
+
+    PAGED_CODE();
+
+    interval.QuadPart = -10000LL;   // 1 ms
+
+    for (pass = 0; pass < 2; pass++) {
+        epoch = Grace->Epoch;
+        InterlockedExchange(&Grace->Epoch, epoch + 1);
+
+        while (0 != Grace->Readers[epoch & 1]) {
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+}
+
+PVOID
+MouFilter_SnapshotAllocate(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Allocates room for a MOUFILTER_SNAPSHOT.  Snapshots are built by
+    whoever publishes them, never by the service callback, so this is
+    paged and says so.
+
+--*/
+{
+    PVOID   snapshot;
+
+    PAGED_CODE();
+
+    snapshot = ExAllocateFromNPagedLookasideList(&MouFilter_Globals.SnapshotLookaside);
+    if (NULL != snapshot) {
+        InterlockedIncrement(&MouFilter_Globals.SnapshotCount);
+    }
+
+    return snapshot;
+}
+
+VOID
+MouFilter_SnapshotFree(
+    IN PVOID Snapshot
+    )
+{
+    PAGED_CODE();
+
+    ASSERT(0 < MouFilter_Globals.SnapshotCount);
+    InterlockedDecrement(&MouFilter_Globals.SnapshotCount);
+
+    ExFreeToNPagedLookasideList(&MouFilter_Globals.SnapshotLookaside, Snapshot);
+}
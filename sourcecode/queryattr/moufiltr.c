@@ -16,18 +16,118 @@ NTSTATUS DriverEntry (PDRIVER_OBJECT, PUNICODE_STRING);
 
 // Suggest to the compiler different memory allocation
 // settings for different driver functions
+//
+// Internal device controls can be sent at DISPATCH_LEVEL, and power IRPs
+// are too when the stack below is not power pageable, so
+// MouFilter_InternIoCtl and MouFilter_Power stay in nonpaged code.  What
+// they call in PAGE (connecting the class driver) only ever happens at
+// PASSIVE_LEVEL, and says so with PAGED_CODE().
+//
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, MouFilter_AddDevice)
 #pragma alloc_text (PAGE, MouFilter_CreateClose)
-#pragma alloc_text (PAGE, MouFilter_IoCtl)
-#pragma alloc_text (PAGE, MouFilter_InternIoCtl)
 #pragma alloc_text (PAGE, MouFilter_PnP)
-#pragma alloc_text (PAGE, MouFilter_Power)
 #pragma alloc_text (PAGE, MouFilter_Unload)
 #pragma alloc_text (PAGE, MouFilter_MakeSynchronousIoctl)
 #pragma alloc_text (PAGE, MouFilter_QueryMouseAttributes)
 #endif
 
+//
+// Which debug print categories are enabled (see MOUFILTER_TRACE_CATEGORY)
+//
+ULONG MouFilter_TraceMask = MOUFILTER_TRACE_DEFAULT;
+
+//
+// State shared by all instances of the filter (see moufiltr.h)
+//
+MOUFILTER_GLOBALS MouFilter_Globals;
+
+//
+// Names of the plug and play minor function codes, indexed by IRP_MN_XXX
+//
+static const MOUFILTER_IRP_DESCRIPTOR MouFilter_PnpMinorTable[] = {
+    { NULL, "IRP_MN_START_DEVICE",                  MouFilterTracePnp },  // 0x00
+    { NULL, "IRP_MN_QUERY_REMOVE_DEVICE",           MouFilterTracePnp },  // 0x01
+    { NULL, "IRP_MN_REMOVE_DEVICE",                 MouFilterTracePnp },  // 0x02
+    { NULL, "IRP_MN_CANCEL_REMOVE_DEVICE",          MouFilterTracePnp },  // 0x03
+    { NULL, "IRP_MN_STOP_DEVICE",                   MouFilterTracePnp },  // 0x04
+    { NULL, "IRP_MN_QUERY_STOP_DEVICE",             MouFilterTracePnp },  // 0x05
+    { NULL, "IRP_MN_CANCEL_STOP_DEVICE",            MouFilterTracePnp },  // 0x06
+    { NULL, "IRP_MN_QUERY_DEVICE_RELATIONS",        MouFilterTracePnp },  // 0x07
+    { NULL, "IRP_MN_QUERY_INTERFACE",               MouFilterTracePnp },  // 0x08
+    { NULL, "IRP_MN_QUERY_CAPABILITIES",            MouFilterTracePnp },  // 0x09
+    { NULL, "IRP_MN_QUERY_RESOURCES",               MouFilterTracePnp },  // 0x0A
+    { NULL, "IRP_MN_QUERY_RESOURCE_REQUIREMENTS",   MouFilterTracePnp },  // 0x0B
+    { NULL, "IRP_MN_QUERY_DEVICE_TEXT",             MouFilterTracePnp },  // 0x0C
+    { NULL, "IRP_MN_FILTER_RESOURCE_REQUIREMENTS",  MouFilterTracePnp },  // 0x0D
+    { NULL, "(unused PnP minor 0x0E)",              MouFilterTracePnp },  // 0x0E
+    { NULL, "IRP_MN_READ_CONFIG",                   MouFilterTracePnp },  // 0x0F
+    { NULL, "IRP_MN_WRITE_CONFIG",                  MouFilterTracePnp },  // 0x10
+    { NULL, "IRP_MN_EJECT",                         MouFilterTracePnp },  // 0x11
+    { NULL, "IRP_MN_SET_LOCK",                      MouFilterTracePnp },  // 0x12
+    { NULL, "IRP_MN_QUERY_ID",                      MouFilterTracePnp },  // 0x13
+    { NULL, "IRP_MN_QUERY_PNP_DEVICE_STATE",        MouFilterTracePnp },  // 0x14
+    { NULL, "IRP_MN_QUERY_BUS_INFORMATION",         MouFilterTracePnp },  // 0x15
+    { NULL, "IRP_MN_DEVICE_USAGE_NOTIFICATION",     MouFilterTracePnp },  // 0x16
+    { NULL, "IRP_MN_SURPRISE_REMOVAL",              MouFilterTracePnp },  // 0x17
+    { NULL, "IRP_MN_QUERY_LEGACY_BUS_INFORMATION",  MouFilterTracePnp },  // 0x18
+};
+
+//
+// Names of the power minor function codes, indexed by IRP_MN_XXX
+//
+static const MOUFILTER_IRP_DESCRIPTOR MouFilter_PowerMinorTable[] = {
+    { NULL, "IRP_MN_WAIT_WAKE",                     MouFilterTracePower },  // 0x00
+    { NULL, "IRP_MN_POWER_SEQUENCE",                MouFilterTracePower },  // 0x01
+    { NULL, "IRP_MN_SET_POWER",                     MouFilterTracePower },  // 0x02
+    { NULL, "IRP_MN_QUERY_POWER",                   MouFilterTracePower },  // 0x03
+};
+
+//
+// The dispatch table, indexed by IRP_MJ_XXX.  DriverEntry copies the
+// handlers from here into the driver object; everything we do not intercept
+// goes straight to MouFilter_DispatchPassThrough.
+//
+static const MOUFILTER_IRP_DESCRIPTOR MouFilter_MajorFunctionTable[] = {
+    { MouFilter_CreateClose,          "IRP_MJ_CREATE",                   MouFilterTraceIo },     // 0x00
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_CREATE_NAMED_PIPE",        MouFilterTraceOther },  // 0x01
+    { MouFilter_CreateClose,          "IRP_MJ_CLOSE",                    MouFilterTraceIo },     // 0x02
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_READ",                     MouFilterTraceIo },     // 0x03
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_WRITE",                    MouFilterTraceIo },     // 0x04
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_QUERY_INFORMATION",        MouFilterTraceOther },  // 0x05
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SET_INFORMATION",          MouFilterTraceOther },  // 0x06
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_QUERY_EA",                 MouFilterTraceOther },  // 0x07
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SET_EA",                   MouFilterTraceOther },  // 0x08
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_FLUSH_BUFFERS",            MouFilterTraceIo },     // 0x09
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_QUERY_VOLUME_INFORMATION", MouFilterTraceOther },  // 0x0A
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SET_VOLUME_INFORMATION",   MouFilterTraceOther },  // 0x0B
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_DIRECTORY_CONTROL",        MouFilterTraceOther },  // 0x0C
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_FILE_SYSTEM_CONTROL",      MouFilterTraceOther },  // 0x0D
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_DEVICE_CONTROL",           MouFilterTraceIo },     // 0x0E
+    { MouFilter_InternIoCtl,          "IRP_MJ_INTERNAL_DEVICE_CONTROL",  MouFilterTraceIo },     // 0x0F
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SHUTDOWN",                 MouFilterTraceOther },  // 0x10
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_LOCK_CONTROL",             MouFilterTraceOther },  // 0x11
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_CLEANUP",                  MouFilterTraceIo },     // 0x12
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_CREATE_MAILSLOT",          MouFilterTraceOther },  // 0x13
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_QUERY_SECURITY",           MouFilterTraceOther },  // 0x14
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SET_SECURITY",             MouFilterTraceOther },  // 0x15
+    { MouFilter_Power,                "IRP_MJ_POWER",                    MouFilterTracePower,
+      MouFilter_PowerMinorTable,      RTL_NUMBER_OF(MouFilter_PowerMinorTable) },               // 0x16
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SYSTEM_CONTROL",           MouFilterTraceOther },  // 0x17
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_DEVICE_CHANGE",            MouFilterTraceOther },  // 0x18
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_QUERY_QUOTA",              MouFilterTraceOther },  // 0x19
+    { MouFilter_DispatchPassThrough,  "IRP_MJ_SET_QUOTA",                MouFilterTraceOther },  // 0x1A
+    { MouFilter_PnP,                  "IRP_MJ_PNP",                      MouFilterTracePnp,
+      MouFilter_PnpMinorTable,        RTL_NUMBER_OF(MouFilter_PnpMinorTable) },                 // 0x1B
+};
+
+//
+// If the DDK ever grows a new major function, the table above must grow too
+//
+C_ASSERT(RTL_NUMBER_OF(MouFilter_MajorFunctionTable) == IRP_MJ_MAXIMUM_FUNCTION + 1);
+C_ASSERT(RTL_NUMBER_OF(MouFilter_PnpMinorTable) == IRP_MN_QUERY_LEGACY_BUS_INFORMATION + 1);
+C_ASSERT(RTL_NUMBER_OF(MouFilter_PowerMinorTable) == IRP_MN_QUERY_POWER + 1);
+
 NTSTATUS
 DriverEntry (
     IN  PDRIVER_OBJECT  DriverObject,
@@ -42,23 +142,35 @@ Routine Description:
 {
     ULONG i;
 
-    UNREFERENCED_PARAMETER (RegistryPath);
-
 	DbgPrint(("MouFilter_DriverEntry() called\n"));
+
+    //
+    // Before anything allocates; the profiles come from pool
+    //
+    MouFilter_PoolInit();
+
+    MouFilter_ClockInit();
+    MouFilter_ConfigLoad(RegistryPath);
+
+    KeInitializeMutex(&MouFilter_Globals.Lock, 0);
+    InitializeListHead(&MouFilter_Globals.DeviceList);
+
+    ExInitializeNPagedLookasideList(&MouFilter_Globals.SnapshotLookaside,
+                                    NULL,
+                                    NULL,
+                                    0,
+                                    sizeof(MOUFILTER_SNAPSHOT),
+                                    MOUFILTER_POOL_TAG,
+                                    0);
+
     // 
-    // Fill in all the dispatch entry points with the pass through function
-    // and the explicitly fill in the functions we are going to intercept
+    // Fill in all the dispatch entry points from the dispatch table.  The
+    // functions we intercept are already in there; the rest pass through.
     // 
 	for (i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
-        DriverObject->MajorFunction[i] = MouFilter_DispatchPassThrough;
+        DriverObject->MajorFunction[i] = MouFilter_MajorFunctionTable[i].Handler;
     }
 
-    DriverObject->MajorFunction [IRP_MJ_CREATE] =		MouFilter_CreateClose;
-    DriverObject->MajorFunction [IRP_MJ_CLOSE] =        MouFilter_CreateClose;
-    DriverObject->MajorFunction [IRP_MJ_PNP] =          MouFilter_PnP;
-    DriverObject->MajorFunction [IRP_MJ_POWER] =        MouFilter_Power;
-    DriverObject->MajorFunction [IRP_MJ_INTERNAL_DEVICE_CONTROL] = MouFilter_InternIoCtl;
-
     DriverObject->DriverUnload = MouFilter_Unload;
     DriverObject->DriverExtension->AddDevice = MouFilter_AddDevice;
 
@@ -105,23 +217,69 @@ MouFilter_AddDevice(
 
     ASSERT(devExt->TopOfStack);
 
+    //
+    // The IRP for our own requests to the lower drivers, reused for each
+    // of them (see MouFilter_MakeAsynchronousIoctl)
+    //
+    devExt->Ioctl.Irp = IoAllocateIrp(devExt->TopOfStack->StackSize, FALSE);
+    if (NULL == devExt->Ioctl.Irp) {
+        IoDetachDevice(devExt->TopOfStack);
+        IoDeleteDevice(device);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    KeInitializeTimer(&devExt->Ioctl.Timer);
+    KeInitializeDpc(&devExt->Ioctl.TimerDpc, MouFilter_IoctlTimerDpc, devExt);
+
+    ExInitializeFastMutex(&devExt->PublishLock);
+    KeInitializeMutex(&devExt->ActivityLock, 0);
+
+    devExt->AddTime =       KeQueryInterruptTime();
+    devExt->Type =          MouFilterFilterDevice;
     devExt->Self =          device;
     devExt->PDO =           PDO;
     devExt->DeviceState =   PowerDeviceD0;
 
+    status = MouFilter_AttributesInit(devExt);
+    if (!NT_SUCCESS(status)) {
+        IoFreeIrp(devExt->Ioctl.Irp);
+        IoDetachDevice(devExt->TopOfStack);
+        IoDeleteDevice(device);
+        return status;
+    }
+
+    //
+    // Needs PDO, to look up the hardware ID.  Without the configured
+    // transform the mouse still works, so a failure here is not worth
+    // failing the device for
+    //
+    status = MouFilter_ConfigApply(devExt);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_AddDevice() could not apply the configured transform (0x%08x)\n", status);
+        status = STATUS_SUCCESS;
+    }
+
     devExt->SurpriseRemoved = FALSE;
     devExt->Removed =         FALSE;
     devExt->Started =         FALSE;
 
-    device->Flags |= (DO_BUFFERED_IO | DO_POWER_PAGABLE);
+    IoInitializeRemoveLock(&devExt->RemoveLock, MOUFILTER_POOL_TAG, 0, 0);
+    ExInitializeRundownProtection(&devExt->CallbackRundown);
+
+    //
+    // Power IRPs come at whatever IRQL the stack below asks for, so take
+    // its power flags rather than claiming DO_POWER_PAGABLE on our own
+    //
+    device->Flags |= DO_BUFFERED_IO;
+    device->Flags |= devExt->TopOfStack->Flags & (DO_POWER_PAGABLE | DO_POWER_INRUSH);
     device->Flags &= ~DO_DEVICE_INITIALIZING;
 
-	MouFilter_QueryMouseAttributes(devExt->TopOfStack);
+    MouFilter_RegisterDevice(devExt);
+
     return status;
 }
 
 NTSTATUS
-MouFilter_Complete(
+MouFilter_StartComplete(
     IN PDEVICE_OBJECT   DeviceObject,
     IN PIRP             Irp,
     IN PVOID            Context
@@ -129,37 +287,48 @@ MouFilter_Complete(
 /*++
 Routine Description:
 
-    Generic completion routine that allows the driver to send the irp down the 
-    stack, catch it on the way up, and do more processing at the original IRQL.
-    
+    Completion routine for IRP_MN_START_DEVICE.  Runs once the lower drivers
+    have started the device, possibly at DISPATCH_LEVEL, so anything that
+    needs PASSIVE_LEVEL (querying the mouse attributes) is handed to a work
+    item.
+
 --*/
 {
-    PKEVENT             event;
-
-    event = (PKEVENT) Context;
+    PDEVICE_EXTENSION   devExt;
 
-	// this is a unique way to "reference" a parameter
-	// to avoid compile-time warnings, but still avoid using it
-	//
-	//It's defined as: #define UNREFERENCED_PARAMETER(P) (P)
     UNREFERENCED_PARAMETER(DeviceObject);
-    UNREFERENCED_PARAMETER(Irp);
 
-	DbgPrint(("MouFilter_Complete() called\n"));
+	DbgPrint(("MouFilter_StartComplete() called\n"));
 
-    //
-    // We could switch on the major and minor functions of the IRP to perform
-    // different functions, but we know that Context is an event that needs
-    // to be set.
-    //
-	// Wake this event. We set it previously.
-    KeSetEvent(event, 0, FALSE);
+    devExt = (PDEVICE_EXTENSION) Context;
+
+    if (NT_SUCCESS(Irp->IoStatus.Status)) {
+        //
+        // As we are successfully now back from our start device
+        // we can do work.
+        //
+        devExt->Started = TRUE;
+        devExt->Removed = FALSE;
+        devExt->SurpriseRemoved = FALSE;
+
+        devExt->StartTime = KeQueryInterruptTime();
+        InterlockedExchange(&devExt->FirstPacketSeen, 0);
+
+        DbgPrint("MouFilter_StartComplete() device started %I64u ms after AddDevice\n",
+                 (devExt->StartTime - devExt->AddTime) / 10000);
+
+        //
+        // Asked for at PASSIVE_LEVEL, in the attribute cache's work item
+        //
+        MouFilter_AttributesRefresh(devExt);
+    }
 
     //
-    // Allows the event we just woke to do something to the IRP
-	// before it gets sent on its way
+    // MouFilter_PnP already marked the IRP pending and returned
+    // STATUS_PENDING, so there is nothing to propagate
     //
-    return STATUS_MORE_PROCESSING_REQUIRED;
+    IoReleaseRemoveLock(&devExt->RemoveLock, Irp);
+    return STATUS_CONTINUE_COMPLETION;
 }
 
 NTSTATUS
@@ -180,6 +349,10 @@ Routine Description:
 
     PAGED_CODE();
 
+    if (MouFilter_IsControlDevice(DeviceObject)) {
+        return MouFilter_ControlDispatch(DeviceObject, Irp);
+    }
+
 	DbgPrint(("MouFilter_CreateClose() called\n"));
 	
 	irpStack = IoGetCurrentIrpStackLocation(Irp);
@@ -190,7 +363,7 @@ Routine Description:
     switch (irpStack->MajorFunction) {
     case IRP_MJ_CREATE:
     
-        if (NULL == devExt->UpperConnectData.ClassService) {
+        if (NULL == devExt->UpperConnection) {
             //
             // No Connection yet.  How can we be enabled?
             //
@@ -198,8 +371,10 @@ Routine Description:
         }
         else if ( 1 >= InterlockedIncrement(&devExt->EnableCount)) {
             //
-            // First time enable here
+            // First time enable here: what is only needed while somebody
+            // reads the mouse is allocated now rather than in AddDevice
             //
+            MouFilter_ActivityUpdate(devExt);
         }
         else {
             //
@@ -215,10 +390,10 @@ Routine Description:
     
         if (0 >= InterlockedDecrement(&devExt->EnableCount)) {
             //
-            // successfully closed the device, do any appropriate work here
-			// this would be place to free any resources allocated earlier
-			// that are still pointed to in the devExt device extension
+            // successfully closed the device; free what the first create
+            // allocated
             //
+            MouFilter_ActivityUpdate(devExt);
         }
 
         break;
@@ -247,65 +422,75 @@ Routine Description:
 {
     
 	PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    PDEVICE_EXTENSION  devExt;
+    NTSTATUS           status;
 
+    if (MouFilter_IsControlDevice(DeviceObject)) {
+        return MouFilter_ControlDispatch(DeviceObject, Irp);
+    }
 
-	DbgPrint(("MouFilter_DispatchPassThrough() called -- "));
-	switch(irpStack->MajorFunction) {
-		case IRP_MJ_CREATE:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_CREATE\n"));
-			break;
-		case IRP_MJ_PNP:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_PNP\n"));
-			break;
-		case IRP_MJ_POWER:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_POWER\n"));
-			break;
-		case IRP_MJ_READ: 
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_READ\n"));
-			break;
-		case IRP_MJ_WRITE: 
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_WRITE\n"));
-			break;
-		case IRP_MJ_FLUSH_BUFFERS: 
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_FLUSH_BUFFERS\n"));
-			break;
-		case IRP_MJ_QUERY_INFORMATION: 
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_QUERY_INFORMATION\n"));
-			break;
-		case IRP_MJ_SET_INFORMATION: 
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_SET_INFORMATION\n"));
-			break;
-		case IRP_MJ_DEVICE_CONTROL:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_DEVICE_CONTROL\n"));
-			break;
-		case IRP_MJ_INTERNAL_DEVICE_CONTROL:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_INTERNAL_DEVICE_CONTROL\n"));
-			break;
-		case IRP_MJ_SYSTEM_CONTROL:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_SYSTEM_CONTROL\n"));
-			break;
-		case IRP_MJ_CLEANUP:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_CLEANUP\n"));
-			break;
-		case IRP_MJ_CLOSE:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_CLOSE\n"));
-			break;
-		case IRP_MJ_SHUTDOWN:
-			DbgPrint(("MouFiltr.sys saw IRP_MJ_SHUTDOWN\n"));
-			break;
-		default:
-			DbgPrint(("MouFiltr.sys saw an unknown IRP Major Function Code\n"));
-	}
-	
+	MouFilter_TraceIrp("MouFilter_DispatchPassThrough", irpStack);
+
+    devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    //
+    // Keep the device from being removed while the IRP is on its way down
+    //
+    status = IoAcquireRemoveLock(&devExt->RemoveLock, Irp);
+    if (!NT_SUCCESS(status)) {
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
 
     //
     // Pass the IRP to the target
     //
     IoSkipCurrentIrpStackLocation(Irp);
         
-    return IoCallDriver(((PDEVICE_EXTENSION) DeviceObject->DeviceExtension)->TopOfStack, Irp);
+    status = IoCallDriver(devExt->TopOfStack, Irp);
+    IoReleaseRemoveLock(&devExt->RemoveLock, Irp);
+
+    return status;
 }           
 
+VOID
+MouFilter_TraceIrp(
+    IN PCSTR Caller,
+    IN PIO_STACK_LOCATION IrpStack
+    )
+/*++
+Routine Description:
+
+    Prints the name of an IRP (and of its minor function, if the major has
+    a minor table) when its category is enabled in MouFilter_TraceMask.
+    The names are indexed straight out of the descriptor tables.
+
+--*/
+{
+    PCMOUFILTER_IRP_DESCRIPTOR  major;
+
+    ASSERT(IrpStack->MajorFunction <= IRP_MJ_MAXIMUM_FUNCTION);
+    major = &MouFilter_MajorFunctionTable[IrpStack->MajorFunction];
+
+    if (0 == (MouFilter_TraceMask & MOUFILTER_TRACE_BIT(major->Category))) {
+        return;
+    }
+
+    if (IrpStack->MinorFunction < major->MinorCount) {
+        DbgPrint("%s() called -- MouFiltr.sys saw %s / %s\n",
+                 Caller, major->Name, major->Minors[IrpStack->MinorFunction].Name);
+    }
+    else if (NULL != major->Minors) {
+        DbgPrint("%s() called -- MouFiltr.sys saw %s / unknown minor 0x%02x\n",
+                 Caller, major->Name, IrpStack->MinorFunction);
+    }
+    else {
+        DbgPrint("%s() called -- MouFiltr.sys saw %s\n", Caller, major->Name);
+    }
+}
+
 NTSTATUS
 MouFilter_InternIoCtl(
     IN PDEVICE_OBJECT DeviceObject,
@@ -342,9 +527,14 @@ Return Value:
     PDEVICE_EXTENSION           devExt;
     KEVENT                      event;
     PCONNECT_DATA               connectData;
+    CONNECT_DATA                classConnect;
     
     NTSTATUS                    status = STATUS_SUCCESS;
 
+    if (MouFilter_IsControlDevice(DeviceObject)) {
+        return MouFilter_ControlDispatch(DeviceObject, Irp);
+    }
+
 	DbgPrint(("MouFilter_InternIoCtl() called\n"));
 
     devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
@@ -357,14 +547,7 @@ Return Value:
     // Connect a mouse class device driver to the port driver.
     //
     case IOCTL_INTERNAL_MOUSE_CONNECT:
-        //
-        // Only allow one connection. Check for already-used function pointer.
-        //
-        if (devExt->UpperConnectData.ClassService != NULL) {
-            status = STATUS_SHARING_VIOLATION;
-            break;
-        }
-        else if (irpStack->Parameters.DeviceIoControl.InputBufferLength <
+        if (irpStack->Parameters.DeviceIoControl.InputBufferLength <
                 sizeof(CONNECT_DATA)) {
             //
             // invalid buffer, it must not really be a CONNECT_DATA
@@ -374,21 +557,74 @@ Return Value:
         }
 
         //
-        // Store the original function pointer in the device extension.
+        // The class driver's own copy; ours goes down in its place
         //
         connectData = ((PCONNECT_DATA)
             (irpStack->Parameters.DeviceIoControl.Type3InputBuffer));
+        classConnect = *connectData;
+
+        if (!devExt->PortConnected) {
+            //
+            // Hook into the report chain.  Everytime a mouse packet is
+            // reported to the system, MouFilter_ServiceCallback will be
+            // called.  Connects come at PASSIVE_LEVEL, so we wait for the
+            // port driver's answer and only take the class driver on if
+            // it accepted; until we publish, the callback drops packets.
+            //
+            status = IoAcquireRemoveLock(&devExt->RemoveLock, Irp);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            connectData->ClassDeviceObject = devExt->Self;
+            connectData->ClassService = MouFilter_ServiceCallback;
+
+            devExt->PortConnected = TRUE;
 
-        devExt->UpperConnectData = *connectData;
+            KeInitializeEvent(&event, NotificationEvent, FALSE);
+
+            IoCopyCurrentIrpStackLocationToNext(Irp);
+            IoSetCompletionRoutine(Irp,
+                                   (PIO_COMPLETION_ROUTINE) MouFilter_ConnectComplete,
+                                   &event,
+                                   TRUE,
+                                   TRUE,
+                                   TRUE);
+
+            if (STATUS_PENDING == IoCallDriver(devExt->TopOfStack, Irp)) {
+                KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+            }
+
+            status = Irp->IoStatus.Status;
+
+            IoReleaseRemoveLock(&devExt->RemoveLock, Irp);
+
+            if (!NT_SUCCESS(status)) {
+                //
+                // The next connect has to be sent down again
+                //
+                devExt->PortConnected = FALSE;
+
+                IoCompleteRequest(Irp, IO_NO_INCREMENT);
+                return status;
+            }
+        }
 
         //
-        // Hook into the report chain.  Everytime a mouse packet is reported to
-        // the system, MouFilter_ServiceCallback will be called
+        // Report to this class driver from now on (replacing the one
+        // before, if it never disconnected).
         //
-        connectData->ClassDeviceObject = devExt->Self;
-        connectData->ClassService = MouFilter_ServiceCallback;
+        status = MouFilter_ConnectPublish(devExt, &classConnect);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
 
-        break;
+        InterlockedIncrement((PLONG) &devExt->IoctlStats.Connects);
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_SUCCESS;
 
     //
     // Disconnect a mouse class device driver from the port driver.
@@ -396,23 +632,46 @@ Return Value:
     case IOCTL_INTERNAL_MOUSE_DISCONNECT:
 
         //
-        // Clear the connection parameters in the device extension.
+        // Port drivers don't implement this, and we want ours to keep
+        // reporting to us anyway, so it is handled right here: packets
+        // are dropped until the class driver connects again.
         //
-        // devExt->UpperConnectData.ClassDeviceObject = NULL;
-        // devExt->UpperConnectData.ClassService = NULL;
-		//
-		// As the DDK uses this example, it should hopefully not be
-		// neccessary for our use. At least we return "not-implemented"...
+        status = MouFilter_ConnectPublish(devExt, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
 
-        status = STATUS_NOT_IMPLEMENTED;
-        break;
+        InterlockedIncrement((PLONG) &devExt->IoctlStats.Disconnects);
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_SUCCESS;
 
 	//
-    // Might want to capture this in the future.  For now, then pass it down
-    // the stack.  These queries must be successful for the RIT to communicate
-    // with the mouse.
+    // These queries must be successful for the RIT to communicate with the
+    // mouse.  Answer them from the cache when we can; otherwise pass them
+    // down the stack.
     //
     case IOCTL_MOUSE_QUERY_ATTRIBUTES:
+        if ((MouFilter_Config.Flags & MOUFILTER_CONFIG_CACHE_ATTRIBUTES) &&
+            irpStack->Parameters.DeviceIoControl.OutputBufferLength >=
+                sizeof(MOUSE_ATTRIBUTES) &&
+            MouFilter_AttributesLookup(devExt,
+                (PMOUSE_ATTRIBUTES) Irp->AssociatedIrp.SystemBuffer)) {
+
+            InterlockedIncrement((PLONG) &devExt->IoctlStats.AttributeQueriesCached);
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            Irp->IoStatus.Information = sizeof(MOUSE_ATTRIBUTES);
+            IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+            return STATUS_SUCCESS;
+        }
+
+        InterlockedIncrement((PLONG) &devExt->IoctlStats.AttributeQueriesForwarded);
+        break;
+
     default:
         break;
     }
@@ -456,15 +715,22 @@ Return Value:
     PIO_STACK_LOCATION          irpStack;
     NTSTATUS                    status = STATUS_SUCCESS;
     KIRQL                       oldIrql;
-    KEVENT                      event;
 
     PAGED_CODE();
 
-	DbgPrint(("MouFilter_PnP() called\n"));
-
 	devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
     irpStack = IoGetCurrentIrpStackLocation(Irp);
 
+	MouFilter_TraceIrp("MouFilter_PnP", irpStack);
+
+    status = IoAcquireRemoveLock(&devExt->RemoveLock, Irp);
+    if (!NT_SUCCESS(status)) {
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
     switch (irpStack->MinorFunction) {
     case IRP_MN_START_DEVICE: {
 
@@ -475,56 +741,21 @@ Return Value:
         // start device has been passed down to the lower drivers.
         //
 
-		// prepare to pass this irp to the next stack location for processing
+		// the rest of the start is done in MouFilter_StartComplete, which
+		// also releases the remove lock; nobody waits here for the lower
+		// drivers to finish
+        IoMarkIrpPending(Irp);
 		IoCopyCurrentIrpStackLocationToNext(Irp);
 
-		// set a kernel wait "event" so that this driver doesn't run off
-        KeInitializeEvent(&event,
-                          NotificationEvent,
-                          FALSE
-                          );
-
-		// when this IRP is completed, call MouFilter_Complete
         IoSetCompletionRoutine(Irp,
-                               (PIO_COMPLETION_ROUTINE) MouFilter_Complete, 
-                               &event,
+                               (PIO_COMPLETION_ROUTINE) MouFilter_StartComplete, 
+                               devExt,
                                TRUE,
                                TRUE,
-                               TRUE); // No need for Cancel
+                               TRUE);
 
-		// if the driver below us completes the IRP, we'll get a success
-		// otherwise, it will pend the IRP and we'll wait
-        status = IoCallDriver(devExt->TopOfStack, Irp);
-
-        if (STATUS_PENDING == status) {
-            KeWaitForSingleObject(
-               &event,
-               Executive, // Waiting for reason of a driver
-               KernelMode, // Waiting in kernel mode
-               FALSE, // No allert
-               NULL); // No timeout
-        }
-
-        if (NT_SUCCESS(status) && NT_SUCCESS(Irp->IoStatus.Status)) {
-            //
-            // As we are successfully now back from our start device
-            // we can do work.
-            //
-            devExt->Started = TRUE;
-            devExt->Removed = FALSE;
-            devExt->SurpriseRemoved = FALSE;
-
-        }
-
-        //
-        // We must now complete the IRP, since we stopped it in the
-        // completetion routine with MORE_PROCESSING_REQUIRED.
-        //
-        Irp->IoStatus.Status = status;
-        Irp->IoStatus.Information = 0;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-
-        break;
+        IoCallDriver(devExt->TopOfStack, Irp);
+        return STATUS_PENDING;
     }
 
     case IRP_MN_SURPRISE_REMOVAL:
@@ -533,10 +764,15 @@ Return Value:
         //
         devExt->SurpriseRemoved = TRUE;
 
-        // Remove code here
-
         IoSkipCurrentIrpStackLocation(Irp);
         status = IoCallDriver(devExt->TopOfStack, Irp);
+
+        //
+        // The port driver has stopped reporting now; wait out any
+        // service callback still running on another processor.  Later
+        // callbacks drop their packets instead of calling the class driver.
+        //
+        ExWaitForRundownProtectionRelease(&devExt->CallbackRundown);
         break;
 
     case IRP_MN_REMOVE_DEVICE:
@@ -548,12 +784,42 @@ Return Value:
 
         IoSkipCurrentIrpStackLocation(Irp);
         status = IoCallDriver(devExt->TopOfStack, Irp);
+
+        //
+        // Wait for the IRPs still on their way through us.  New ones are
+        // failed with STATUS_DELETE_PENDING from here on.
+        //
+        IoReleaseRemoveLockAndWait(&devExt->RemoveLock, Irp);
+
+        //
+        // Likewise for service callbacks (this returns at once if a surprise
+        // removal already ran the callbacks down)
+        //
+        ExWaitForRundownProtectionRelease(&devExt->CallbackRundown);
+
+        // the lower drivers are done reporting packets to us now
+        MouFilter_DeregisterDevice(devExt);
+        MouFilter_ConnectPublish(devExt, NULL);
+        MouFilter_TransformPublish(devExt, NULL);
+
+        // every handle is closed by now; this only matters if a close
+        // never reached us
+        ASSERT(0 == devExt->EnableCount);
+        devExt->EnableCount = 0;
+        MouFilter_ActivityUpdate(devExt);
+
+        // the remove lock also covered our own requests, so the IRP is idle
+        ASSERT(0 == devExt->Ioctl.Busy);
+        IoFreeIrp(devExt->Ioctl.Irp);
+
+        // and so did the attribute work item
+        IoFreeWorkItem(devExt->AttributesCache.WorkItem);
 		
 		// we must release the device since it wasn't surprise_removal
         IoDetachDevice(devExt->TopOfStack); 
         IoDeleteDevice(DeviceObject);
 
-        break;
+        return status;
 
     case IRP_MN_QUERY_REMOVE_DEVICE:
     case IRP_MN_QUERY_STOP_DEVICE:
@@ -584,6 +850,7 @@ Return Value:
         break;
     }
 
+    IoReleaseRemoveLock(&devExt->RemoveLock, Irp);
     return status;
 }
 
@@ -616,14 +883,22 @@ Return Value:
     PDEVICE_EXTENSION   devExt;
     POWER_STATE         powerState;
     POWER_STATE_TYPE    powerType;
+    NTSTATUS            status;
 
-    PAGED_CODE();
-
-	DbgPrint(("MouFilter_Power() called\n"));
-	
 	devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
     irpStack = IoGetCurrentIrpStackLocation(Irp);
 
+	MouFilter_TraceIrp("MouFilter_Power", irpStack);
+
+    status = IoAcquireRemoveLock(&devExt->RemoveLock, Irp);
+    if (!NT_SUCCESS(status)) {
+        PoStartNextPowerIrp(Irp);
+        Irp->IoStatus.Status = status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return status;
+    }
+
     powerType = irpStack->Parameters.Power.Type;
     powerState = irpStack->Parameters.Power.State;
 
@@ -645,7 +920,10 @@ Return Value:
 	// This routine must be called by every driver in the device stack - from the April 2005 MSDN Library
     PoStartNextPowerIrp(Irp);
     IoSkipCurrentIrpStackLocation(Irp);
-    return PoCallDriver(devExt->TopOfStack, Irp);
+    status = PoCallDriver(devExt->TopOfStack, Irp);
+
+    IoReleaseRemoveLock(&devExt->RemoveLock, Irp);
+    return status;
 }
 
 
@@ -728,28 +1006,187 @@ For reference:
 
     PDEVICE_EXTENSION   devExt;
 	PMOUSE_INPUT_DATA	pCursor; // cursor for looping
+	PMOUFILTER_TAP		tap;
+	PMOUFILTER_BATCH	batch;
+	BOOLEAN				attributesChanged;
+	ULONGLONG			now;
+	ULONG				spacing;
+	ULONG				slot;
+	PMOUFILTER_TRANSFORM	transform;
+	PMOUFILTER_ACTIVITY		activity;
+	PMOUFILTER_OFFLOAD		offload;
 	
 	// if there's at least one input packet, this pointer is good. trust the executive's pointers!
-	DbgPrint("MouFilter_ServiceCallback() called for UnitId %hu\n", InputDataStart->UnitId);
+	if (MOUFILTER_TRACING(MouFilterTracePackets)) {
+		DbgPrint("MouFilter_ServiceCallback() called for UnitId %hu\n", InputDataStart->UnitId);
+	}
 
     devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
 
-	// this is where we can mangle/delete/add packets
+	// once removal has begun the class driver may already be gone, so the
+	// packets are dropped (but reported as consumed) instead
+	if (!ExAcquireRundownProtection(&devExt->CallbackRundown)) {
+		*InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+		InterlockedExchangeAdd((PLONG) &devExt->Stats.PacketsDropped, (LONG) *InputDataConsumed);
+		return;
+	}
+
+	// only ever written from here, so no interlocked operations needed
+	devExt->Stats.Callbacks++;
+	devExt->Stats.Packets += (ULONG) (InputDataEnd - InputDataStart);
+
+	// one reading of the clock for the whole batch; the packets in it are
+	// spread out behind the last one (see clock.c)
+	now = MouFilter_ClockBatch(&devExt->Clock,
+							   (ULONG) (InputDataEnd - InputDataStart),
+							   KeQueryInterruptTime(),
+							   &spacing);
+
+	// time from device arrival to the first packet, once per start
+	if (0 == devExt->FirstPacketSeen &&
+		0 == InterlockedExchange(&devExt->FirstPacketSeen, 1)) {
+		DbgPrint("MouFilter_ServiceCallback() first packet %I64u ms after AddDevice, %I64u ms after start\n",
+				 (now - devExt->AddTime) / 10000, (now - devExt->StartTime) / 10000);
+	}
+
+	// hand user mode consumers the packets exactly as the port driver sent them
+	tap = devExt->Tap;
+	if (NULL != tap) {
+		MouFilter_TapPublish(tap, InputDataStart, InputDataEnd, now, spacing);
+	}
+
+	batch = devExt->Batch;
+	if (NULL != batch) {
+		MouFilter_BatchAppend(batch, InputDataStart, InputDataEnd);
+	}
+
+	// from here on, pointers published to the callback stay valid until we
+	// leave the grace period section (see grace.c)
+	slot = MouFilter_GraceEnter(&devExt->Grace);
+
+	activity = devExt->Activity;
+	offload = NULL;
+	if (NULL != activity) {
+		MouFilter_ActivityRecord(activity, (ULONG) (InputDataEnd - InputDataStart), now);
+
+		if (NULL != activity->Offload.Thread) {
+			offload = &activity->Offload;
+		}
+	}
+	else if (0 != devExt->ActivityRetiring) {
+		// the last close is still handing the old block's packets to the
+		// class driver (see activity.c); these must not overtake them, and
+		// with the mouse closed nobody is reading them anyway
+		MouFilter_GraceLeave(&devExt->Grace, slot);
+
+		*InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+		InterlockedExchangeAdd((PLONG) &devExt->Stats.PacketsDropped, (LONG) *InputDataConsumed);
+
+		ExReleaseRundownProtection(&devExt->CallbackRundown);
+		return;
+	}
+
+	// this is where we can mangle/delete/add packets, unless the offload
+	// thread does it for us
+	transform = devExt->Transform;
+	if (NULL != transform && NULL == offload) {
+		MouFilter_TransformApply(devExt, transform, InputDataStart, InputDataEnd);
+	}
+
+	attributesChanged = FALSE;
 	for (pCursor = InputDataStart; pCursor < InputDataEnd; pCursor++) {
 		// do something with the current MOUSE_INPUT_DATA
 
-		DbgPrint("Mouse moved X = %li and Y = %li\n", pCursor->LastX, pCursor->LastY);
+		if (pCursor->Flags & MOUSE_ATTRIBUTES_CHANGED) {
+			attributesChanged = TRUE;
+		}
+
+		if (MOUFILTER_TRACING(MouFilterTracePackets)) {
+			DbgPrint("Mouse moved X = %li and Y = %li\n", pCursor->LastX, pCursor->LastY);
+		}
 	}
 
     // Here we stop playing with the data!
-    // UpperConnectData must be called at DISPATCH
+    // UpperConnection must be called at DISPATCH
     //
-    (*(PSERVICE_CALLBACK_ROUTINE) devExt->UpperConnectData.ClassService)(
-        devExt->UpperConnectData.ClassDeviceObject,
-        InputDataStart,
-        InputDataEnd,
-        InputDataConsumed
-        );
+	if (NULL != offload) {
+		// the transform and the class driver get these in the offload
+		// thread (see offload.c)
+		MouFilter_OffloadReport(offload, InputDataStart, InputDataEnd);
+		*InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+	}
+	else {
+		MouFilter_ServiceDeliver(devExt, activity, InputDataStart, InputDataEnd, now, InputDataConsumed);
+	}
+
+	MouFilter_GraceLeave(&devExt->Grace, slot);
+
+	// the cached attributes are stale now; fetch them again in the background
+	if (attributesChanged) {
+		MouFilter_AttributesInvalidate(devExt);
+		MouFilter_AttributesRefresh(devExt);
+	}
+
+	ExReleaseRundownProtection(&devExt->CallbackRundown);
+}
+
+VOID
+MouFilter_ServiceDeliver(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_ACTIVITY Activity OPTIONAL,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Now,
+    OUT PULONG InputDataConsumed
+    )
+/*++
+Routine Description:
+
+    Hands finished packets to the class driver, for the service callback
+    and for the offload thread (see offload.c).  Called at DISPATCH_LEVEL
+    inside a grace period section.
+
+--*/
+{
+    PCONNECT_DATA   connection;
+
+    //
+    // One read of the published connection; it stays valid until the
+    // caller leaves the grace period, even if the class driver disconnects
+    // meanwhile
+    //
+    connection = DevExt->UpperConnection;
+
+    if (NULL != connection && NULL != Activity && 0 != MouFilter_Config.CoalesceTime) {
+        //
+        // Motion may be held back for a few hundred microseconds and sent
+        // with the packets after it (see coalesce.c)
+        //
+        MouFilter_CoalesceReport(&Activity->Coalesce, connection, InputDataStart, InputDataEnd, Now);
+        *InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+    }
+    else if (NULL != connection) {
+        //
+        // The offload thread gets here as well as the callback
+        //
+        InterlockedIncrement((PLONG) &DevExt->Stats.ClassServiceCalls);
+
+        (*(PSERVICE_CALLBACK_ROUTINE) connection->ClassService)(
+            connection->ClassDeviceObject,
+            InputDataStart,
+            InputDataEnd,
+            InputDataConsumed
+            );
+    }
+    else {
+        //
+        // No class driver right now; the packets go nowhere.  The offload
+        // thread can get here while the callback runs, hence the
+        // interlocked add.
+        //
+        *InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+        InterlockedExchangeAdd((PLONG) &DevExt->Stats.PacketsDropped, (LONG) *InputDataConsumed);
+    }
 }
 
 VOID
@@ -779,36 +1216,60 @@ Return Value:
 
     UNREFERENCED_PARAMETER(Driver);
 
+    //
+    // Every filter device is gone, and each gave its snapshots back
+    //
+    ASSERT(0 == MouFilter_Globals.SnapshotCount);
+    ExDeleteNPagedLookasideList(&MouFilter_Globals.SnapshotLookaside);
+
+    MouFilter_ProfileUnload();
+
+    MouFilter_PoolReport();
+
     ASSERT(NULL == Driver->DeviceObject);
 }
 
 NTSTATUS
-MouFilter_MakeSynchronousIoctl(
-    IN PDEVICE_OBJECT    TopOfDeviceStack,
-    IN ULONG         IoctlControlCode,
-    PVOID             InputBuffer,
-    ULONG             InputBufferLength,
-    PVOID             OutputBuffer,
-    ULONG             OutputBufferLength
+MouFilter_MakeAsynchronousIoctl(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             IoctlControlCode,
+    IN PVOID             InputBuffer,
+    IN ULONG             InputBufferLength,
+    OUT PVOID            OutputBuffer,
+    IN ULONG             OutputBufferLength,
+    IN ULONG             TimeoutMs,
+    IN PMOUFILTER_IOCTL_CALLBACK Callback,
+    IN PVOID             Context
     )
 /*++
 
-	http://msdn.microsoft.com/library/default.asp?url=/library/en-us/kmarch/hh/kmarch/k104_dca88c92-682a-437e-963b-6fac4e9c39bf.xml.asp
-	describes basically this function
+Routine Description:
+
+    Sends an internal METHOD_BUFFERED IOCTL to the lower drivers on the
+    device's preallocated IRP, without waiting for it.  Callable at
+    IRQL <= DISPATCH_LEVEL.
+
+    If this returns STATUS_PENDING, Callback is called exactly once when the
+    request finishes (at IRQL <= DISPATCH_LEVEL), after up to
+    OutputBufferLength bytes of the result have been copied to OutputBuffer.
+    Anything else means the request was never sent and Callback will not be
+    called.  STATUS_DEVICE_BUSY means the IRP is still out for an earlier
+    request.
 
 Arguments:
 
-    TopOfDeviceStack-
+    DevExt             - Filter device whose lower drivers get the request
 
-    IoctlControlCode              - Value of the IOCTL request
+    IoctlControlCode   - Value of the IOCTL request
 
-    InputBuffer        - Buffer to be sent to the TopOfDeviceStack
+    InputBuffer        - Copied into the IRP before it is sent
 
-    InputBufferLength  - Size of buffer to be sent to the TopOfDeviceStack
+    OutputBuffer       - Must stay resident until Callback runs
 
-    OutputBuffer       - Buffer for received data from the TopOfDeviceStack
+    TimeoutMs          - Cancel the IRP if it has not come back by then, or
+                         0 to wait as long as it takes
 
-    OutputBufferLength - Size of receive buffer from the TopOfDeviceStack
+    Callback, Context  - Called when the request is done
 
 Return Value:
 
@@ -816,74 +1277,273 @@ Return Value:
 
 --*/
 {
-    KEVENT              event;
-    PIRP                irp;
-    IO_STATUS_BLOCK     ioStatus;
-    NTSTATUS status;
+    PMOUFILTER_IOCTL    ioctl = &DevExt->Ioctl;
+    PIO_STACK_LOCATION  nextStack;
+    LARGE_INTEGER       dueTime;
+    NTSTATUS            status;
 
-    PAGED_CODE();
-	
-	//
-    // Creating Device control IRP and send it to the another
-    // driver without setting a completion routine.
+    if (METHOD_BUFFERED != (IoctlControlCode & 3) ||
+        InputBufferLength > MOUFILTER_IOCTL_BUFFER_SIZE ||
+        OutputBufferLength > MOUFILTER_IOCTL_BUFFER_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (0 != InterlockedCompareExchange(&ioctl->Busy, 1, 0)) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    //
+    // Removal waits for the request, just like for IRPs we forward
     //
+    status = IoAcquireRemoveLock(&DevExt->RemoveLock, ioctl);
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&ioctl->Busy, 0);
+        return status;
+    }
 
-    KeInitializeEvent(&event, NotificationEvent, FALSE);
-
-    irp = IoBuildDeviceIoControlRequest (
-                            IoctlControlCode,
-                            TopOfDeviceStack,
-                            InputBuffer,
-                            InputBufferLength,
-                            OutputBuffer,
-                            OutputBufferLength,
-                            TRUE, // If TRUE, the routine sets the IRP's major function code 
-								  // to IRP_MJ_INTERNAL_DEVICE_CONTROL. Otherwise, the routine 
-								  // sets the IRP's major function code to IRP_MJ_DEVICE_CONTROL. 
-                            &event,
-                            &ioStatus);
-
-    if (NULL == irp) {
-        return STATUS_INSUFFICIENT_RESOURCES;
+    IoReuseIrp(ioctl->Irp, STATUS_NOT_SUPPORTED);
+
+    if (0 != InputBufferLength) {
+        RtlCopyMemory(ioctl->Buffer, InputBuffer, InputBufferLength);
+    }
+    ioctl->Irp->AssociatedIrp.SystemBuffer = ioctl->Buffer;
+
+    nextStack = IoGetNextIrpStackLocation(ioctl->Irp);
+    nextStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    nextStack->Parameters.DeviceIoControl.IoControlCode = IoctlControlCode;
+    nextStack->Parameters.DeviceIoControl.InputBufferLength = InputBufferLength;
+    nextStack->Parameters.DeviceIoControl.OutputBufferLength = OutputBufferLength;
+
+    IoSetCompletionRoutine(ioctl->Irp,
+                           (PIO_COMPLETION_ROUTINE) MouFilter_IoctlComplete,
+                           DevExt,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+
+    ioctl->OutputBuffer = OutputBuffer;
+    ioctl->OutputBufferLength = OutputBufferLength;
+    ioctl->Callback = Callback;
+    ioctl->Context = Context;
+
+    ioctl->RefCount = 1;
+    if (0 != TimeoutMs) {
+        ioctl->RefCount = 2;
+        dueTime.QuadPart = -10000LL * TimeoutMs;
+        KeSetTimer(&ioctl->Timer, dueTime, &ioctl->TimerDpc);
     }
 
+    IoCallDriver(DevExt->TopOfStack, ioctl->Irp);
 
-    status = IoCallDriver(TopOfDeviceStack, irp);
+    return STATUS_PENDING;
+}
 
-    if (status == STATUS_PENDING) {
+NTSTATUS
+MouFilter_IoctlComplete(
+    IN PDEVICE_OBJECT   DeviceObject,
+    IN PIRP             Irp,
+    IN PVOID            Context
+    )
+/*++
+Routine Description:
+
+    Completion routine of the preallocated IRP.  The IRP is ours, so it
+    always stops here with STATUS_MORE_PROCESSING_REQUIRED.
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt = (PDEVICE_EXTENSION) Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+
+    //
+    // If the timer is still pending it will never run, so drop its
+    // reference too.  Otherwise its DPC drops it.
+    //
+    if (KeCancelTimer(&devExt->Ioctl.Timer)) {
+        InterlockedDecrement(&devExt->Ioctl.RefCount);
+    }
+
+    if (0 == InterlockedDecrement(&devExt->Ioctl.RefCount)) {
+        MouFilter_IoctlFinish(devExt);
+    }
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+VOID
+MouFilter_IoctlTimerDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+
+    The request timed out.  Cancelling an IRP that has already come back is
+    harmless, since it is not reused until MouFilter_IoctlFinish runs.
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt = (PDEVICE_EXTENSION) DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    IoCancelIrp(devExt->Ioctl.Irp);
+
+    if (0 == InterlockedDecrement(&devExt->Ioctl.RefCount)) {
+        MouFilter_IoctlFinish(devExt);
+    }
+}
+
+VOID
+MouFilter_IoctlFinish(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Hands the result of the preallocated IRP to the caller and frees the IRP
+    for the next request (which the callback itself may send).
+
+--*/
+{
+    PMOUFILTER_IOCTL            ioctl = &DevExt->Ioctl;
+    NTSTATUS                    status;
+    ULONG_PTR                   information;
+    PMOUFILTER_IOCTL_CALLBACK   callback;
+    PVOID                       context;
+
+    status = ioctl->Irp->IoStatus.Status;
+    information = ioctl->Irp->IoStatus.Information;
+
+    if (NT_SUCCESS(status) && NULL != ioctl->OutputBuffer) {
+        if (information > ioctl->OutputBufferLength) {
+            information = ioctl->OutputBufferLength;
+        }
+        RtlCopyMemory(ioctl->OutputBuffer, ioctl->Buffer, information);
+    }
+
+    callback = ioctl->Callback;
+    context = ioctl->Context;
+
+    InterlockedExchange(&ioctl->Busy, 0);
+
+    (*callback)(DevExt, status, information, context);
+
+    IoReleaseRemoveLock(&DevExt->RemoveLock, ioctl);
+}
+
+NTSTATUS
+MouFilter_MakeSynchronousIoctl(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             IoctlControlCode,
+    IN PVOID             InputBuffer,
+    IN ULONG             InputBufferLength,
+    OUT PVOID            OutputBuffer,
+    IN ULONG             OutputBufferLength,
+    IN ULONG             TimeoutMs,
+    OUT PULONG_PTR       Information OPTIONAL
+    )
+/*++
+
+	Sends an internal IOCTL to the lower drivers and waits for the answer:
+	MouFilter_MakeAsynchronousIoctl on the device's preallocated IRP, plus
+	a wait.  Unlike IoBuildDeviceIoControlRequest this allocates nothing
+	per call.
+
+Arguments:
+
+    DevExt             - Filter device whose lower drivers get the request
+
+    IoctlControlCode   - Value of the IOCTL request
+
+    InputBuffer        - Buffer to be sent to the lower drivers
+
+    InputBufferLength  - Size of buffer to be sent to the lower drivers
+
+    OutputBuffer       - Buffer for received data from the lower drivers
+
+    OutputBufferLength - Size of receive buffer from the lower drivers
+
+    TimeoutMs          - Give up (cancel the IRP) after this long, or 0 for
+                         no time out
+
+    Information        - Receives the bytes the lower drivers returned
+
+Return Value:
+
+    NT status code
+
+--*/
+{
+    MOUFILTER_SYNC_IOCTL    sync;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    KeInitializeEvent(&sync.Event, NotificationEvent, FALSE);
+    sync.Information = 0;
+
+    status = MouFilter_MakeAsynchronousIoctl(DevExt,
+                                             IoctlControlCode,
+                                             InputBuffer,
+                                             InputBufferLength,
+                                             OutputBuffer,
+                                             OutputBufferLength,
+                                             TimeoutMs,
+                                             MouFilter_SynchronousIoctlDone,
+                                             &sync);
+
+    if (STATUS_PENDING == status) {
         //
-        // You must wait here for the IRP to be completed because:
-        // 1) The IoBuildDeviceIoControlRequest associates the IRP with the
-        //     thread and if the thread exits for any reason, it would cause the IRP
-        //     to be canceled.
-        // 2) The Event and IoStatus block memory is from the stack and we
-        //     cannot go out of scope.
-        // This event will be signaled by the I/O manager when the
-        // IRP is completed.
+        // sync and OutputBuffer live on this stack, so the wait must be a
+        // KernelMode one to keep the stack from being paged out.
         //
-        status = KeWaitForSingleObject(
-                     &event,
-                     Executive, // wait reason
-                     KernelMode, // To prevent stack from being paged out.
-                     FALSE,     // You are not alertable
-                     NULL);     // No time out !!!!
-
-        status = ioStatus.Status;
+        KeWaitForSingleObject(
+            &sync.Event,
+            Executive, // wait reason
+            KernelMode, // To prevent stack from being paged out.
+            FALSE,     // You are not alertable
+            NULL);     // the timer (if any) ends the request, not the wait
+
+        status = sync.Status;
     }
 
-	// Must not call any other functions on the IRP -- the I/O Manager frees synchronus irps
-	// when a lower driver completes them with IoCompleteRequest(). We simply return a status
-	// value, and the supplied buffer now is filled!
+    if (ARGUMENT_PRESENT(Information)) {
+        *Information = sync.Information;
+    }
 
     return status;
 }
 
+VOID
+MouFilter_SynchronousIoctlDone(
+    IN PDEVICE_EXTENSION DevExt,
+    IN NTSTATUS          Status,
+    IN ULONG_PTR         Information,
+    IN PVOID             Context
+    )
+{
+    PMOUFILTER_SYNC_IOCTL   sync = (PMOUFILTER_SYNC_IOCTL) Context;
+
+    UNREFERENCED_PARAMETER(DevExt);
+
+    sync->Status = Status;
+    sync->Information = Information;
+    KeSetEvent(&sync->Event, IO_NO_INCREMENT, FALSE);
+}
+
 VOID 
 MouFilter_QueryMouseAttributes(
-	IN PDEVICE_OBJECT    TopOfDeviceStack
+	IN PDEVICE_EXTENSION DevExt
 )
 /*
-	This calls the MakeSynchronusIoctl function above. Since that function uses IoBuildDeviceIoControlRequest,
+	This calls the MakeSynchronusIoctl function above. Since that function waits for the IRP to come back,
 	it MUST be called at IRQL=Passive Level. Plus, the functions are set to be paged, so... you need the pages ;).
 
 	This function requests from MakeSynchronousIoctl() the results of IOCTL_MOUSE_QUERY_ATTRIBUTES in a specific buffer.
@@ -929,6 +1589,8 @@ MouFilter_QueryMouseAttributes(
 {
 	NTSTATUS status;
 	MOUSE_ATTRIBUTES m;
+	ULONG generation;
+	ULONG_PTR information;
 
 	PAGED_CODE();
 
@@ -936,9 +1598,23 @@ MouFilter_QueryMouseAttributes(
 		DbgPrint(("MouFiltr_QueryMouseAtttributes was called at != PASSIVE_LEVEL, exiting.\n"));
 		return;
 	}
-	status = MouFilter_MakeSynchronousIoctl(TopOfDeviceStack, IOCTL_MOUSE_QUERY_ATTRIBUTES, NULL, 0, &m, sizeof(MOUSE_ATTRIBUTES));
+	generation = MouFilter_AttributesInvalidate(DevExt);
+	status = MouFilter_MakeSynchronousIoctl(DevExt, IOCTL_MOUSE_QUERY_ATTRIBUTES, NULL, 0, &m, sizeof(MOUSE_ATTRIBUTES), MouFilter_Config.AttributesTimeout, &information);
+
+	// a short answer leaves part of m uninitialized; treat it as a failure
+	if(NT_SUCCESS(status) && information < sizeof(MOUSE_ATTRIBUTES)) {
+		status = STATUS_BUFFER_TOO_SMALL;
+	}
 
 	if(NT_SUCCESS(status)) {
+		// keep it for the class driver's queries (unless it changed meanwhile)
+		if(!MouFilter_AttributesStore(DevExt, &m, generation)) {
+			MouFilter_AttributesRefresh(DevExt);
+		}
+
+		// a profile may be waiting for this kind of mouse
+		MouFilter_ProfileApplyIdentifier(DevExt, m.MouseIdentifier);
+
 		DbgPrint(("IOCTL_MOUSE_QUERY_ATTRIBUTES was STATUS_SUCCESS\n"));
 		switch(m.MouseIdentifier) {
 			case BALLPOINT_I8042_HARDWARE:
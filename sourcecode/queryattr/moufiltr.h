@@ -15,6 +15,7 @@ Last Modified: 2005-September-20
 #include "kbdmou.h"
 #include <ntddmou.h>
 #include <stdio.h>
+#include "public.h"
 
 #define MOUFILTER_POOL_TAG (ULONG) 'tlFM'
 #undef ExAllocatePool
@@ -27,16 +28,484 @@ Last Modified: 2005-September-20
 #define DbgRaiseIrql(_x_,_y_)       KeRaiseIrql(_x_,_y_)
 #define DbgLowerIrql(_x_)           KeLowerIrql(_x_)
 
+//
+// Checked builds put a guard around every block (see pool.c).  Memory that
+// has to stay page aligned, like the tap ring, calls the pool directly.
+//
+#undef ExAllocatePool
+#undef ExFreePool
+#define ExAllocatePool(type, size)  MouFilter_AllocatePool(type, size)
+#define ExFreePool(block)           MouFilter_FreePool(block)
+
+#define MOUFILTER_POOL_TRACK        0x00000001  // MouFilter_PoolFlags
+
 #else   // DBG
 
 #define TRAP()
 #define DbgRaiseIrql(_x_,_y_)
 #define DbgLowerIrql(_x_)
 
+#define MouFilter_PoolInit()
+#define MouFilter_PoolReport()
+
+#endif
+
+//
+// Debug print categories.  Each IRP major function belongs to one of these,
+// and MouFilter_TraceMask decides which categories actually get printed.
+// MouFilterTracePackets covers the service callback, which runs for every
+// batch of packets; it is off unless asked for, since DbgPrint is not
+// compiled out of free builds.
+//
+typedef enum _MOUFILTER_TRACE_CATEGORY {
+    MouFilterTraceIo = 0,
+    MouFilterTracePnp,
+    MouFilterTracePower,
+    MouFilterTraceOther,
+    MouFilterTracePackets
+} MOUFILTER_TRACE_CATEGORY;
+
+#define MOUFILTER_TRACE_BIT(_c_)    (1UL << (_c_))
+#define MOUFILTER_TRACE_ALL         0xFFFFFFFF
+#define MOUFILTER_TRACE_DEFAULT     (MOUFILTER_TRACE_ALL & ~MOUFILTER_TRACE_BIT(MouFilterTracePackets))
+
+#define MOUFILTER_TRACING(_c_)      (0 != (MouFilter_TraceMask & MOUFILTER_TRACE_BIT(_c_)))
+
+//
+// One entry per IRP major (or minor) function code.  The major function
+// table is what DriverEntry copies into DriverObject->MajorFunction, so the
+// handler and the name printed for an IRP always come from the same place.
+//
+typedef struct _MOUFILTER_IRP_DESCRIPTOR
+{
+    PDRIVER_DISPATCH                        Handler;    // NULL in the minor tables
+    PCSTR                                   Name;
+    MOUFILTER_TRACE_CATEGORY                Category;
+
+    //
+    // Names for the minor function codes of this major, if it has any
+    //
+    const struct _MOUFILTER_IRP_DESCRIPTOR *Minors;
+    ULONG                                   MinorCount;
+} MOUFILTER_IRP_DESCRIPTOR, *PMOUFILTER_IRP_DESCRIPTOR;
+
+typedef const MOUFILTER_IRP_DESCRIPTOR *PCMOUFILTER_IRP_DESCRIPTOR;
+
+extern ULONG MouFilter_TraceMask;
+
+//
+// The filter devices and the control device share one dispatch table, so
+// both of their extensions start with one of these to tell them apart.
+//
+typedef enum _MOUFILTER_DEVICE_TYPE {
+    MouFilterFilterDevice = 0,
+    MouFilterControlDevice
+} MOUFILTER_DEVICE_TYPE;
+
+#define MouFilter_IsControlDevice(_DeviceObject_) \
+    (MouFilterControlDevice == *(MOUFILTER_DEVICE_TYPE *) (_DeviceObject_)->DeviceExtension)
+
+//
+// Packet tap (see public.h for the part user mode sees)
+//
+#define MOUFILTER_TAP_RECORDS       1024    // must be a power of two
+#define MOUFILTER_TAP_MAX_WAITERS   8
+
+typedef struct _MOUFILTER_TAP
+{
+    //
+    // The pages shared with user mode: the header, then the records
+    //
+    PMOUFILTR_TAP_HEADER    Header;
+    PMOUFILTR_TAP_RECORD    Records;
+    PMDL                    Mdl;
+    ULONG                   Size;
+
+    //
+    // The producer's own copy of Header->Head.  We never read anything
+    // back out of the shared pages that user mode could have scribbled on.
+    //
+    ULONG                   Head;
+
+    //
+    // One reference held by the device extension, plus one per mapping
+    //
+    LONG                    RefCount;
+
+    //
+    // Events of the consumers that wait instead of polling
+    //
+    KSPIN_LOCK              WaiterLock;
+    PKEVENT                 Waiters[MOUFILTER_TAP_MAX_WAITERS];
+
+} MOUFILTER_TAP, *PMOUFILTER_TAP;
+
+//
+// One user mode mapping of a tap, owned by the handle that asked for it
+//
+typedef struct _MOUFILTER_TAP_MAPPING
+{
+    LIST_ENTRY      ListEntry;      // on MOUFILTER_FILE_CONTEXT.Mappings
+    ULONG           InstanceId;
+    PMOUFILTER_TAP  Tap;            // referenced
+    PVOID           UserAddress;
+    PEPROCESS       Process;        // referenced; the address is only good in here
+    PKEVENT         Event;          // referenced, or NULL if polling
+    ULONG           WaiterSlot;
+
+} MOUFILTER_TAP_MAPPING, *PMOUFILTER_TAP_MAPPING;
+
+//
+// Batched reads (see public.h).  Packets wait in a small ring until a
+// pended IOCTL_MOUFILTR_READ_BATCH can take a worthwhile number of them.
+//
+#define MOUFILTER_BATCH_RECORDS     512     // must be a power of two
+
+typedef struct _MOUFILTER_BATCH
+{
+    //
+    // Guards everything in here, including the cancel-safe queue
+    //
+    KSPIN_LOCK          Lock;
+
+    IO_CSQ              Csq;
+    LIST_ENTRY          PendingIrps;
+
+    //
+    // Each request carries its own trigger (see batch.c); the timer runs
+    // at the timeout of the one at the head of the queue
+    //
+    KTIMER              Timer;
+    KDPC                TimerDpc;
+    BOOLEAN             TimerArmed;
+
+    //
+    // Packets waiting for a request
+    //
+    ULONG               First;
+    ULONG               Count;
+    ULONG               Lost;
+    MOUSE_INPUT_DATA    Records[MOUFILTER_BATCH_RECORDS];
+
+} MOUFILTER_BATCH, *PMOUFILTER_BATCH;
+
+//
+// Internal IOCTLs the filter sends to the lower drivers itself.  Each filter
+// device allocates one IRP for this up front and reuses it, so only one
+// such request can be outstanding per device at a time.
+//
+#define MOUFILTER_IOCTL_BUFFER_SIZE 64      // METHOD_BUFFERED only
+
+struct _DEVICE_EXTENSION;
+
+typedef VOID
+(*PMOUFILTER_IOCTL_CALLBACK) (
+    IN struct _DEVICE_EXTENSION *DevExt,
+    IN NTSTATUS Status,
+    IN ULONG_PTR Information,
+    IN PVOID Context
+    );
+
+typedef struct _MOUFILTER_IOCTL
+{
+    PIRP                        Irp;
+
+    //
+    // Nonzero while Irp is out
+    //
+    LONG                        Busy;
+
+    //
+    // One reference for the completion routine and, if the request has a
+    // timeout, one for the timer DPC; whoever lets go last finishes it
+    //
+    LONG                        RefCount;
+    KTIMER                      Timer;
+    KDPC                        TimerDpc;
+
+    //
+    // Where the caller wants the results
+    //
+    PVOID                       OutputBuffer;
+    ULONG                       OutputBufferLength;
+    PMOUFILTER_IOCTL_CALLBACK   Callback;
+    PVOID                       Context;
+
+    //
+    // The IRP's system buffer
+    //
+    ULONGLONG                   Buffer[MOUFILTER_IOCTL_BUFFER_SIZE / sizeof(ULONGLONG)];
+
+} MOUFILTER_IOCTL, *PMOUFILTER_IOCTL;
+
+//
+// What MouFilter_MakeSynchronousIoctl waits on
+//
+typedef struct _MOUFILTER_SYNC_IOCTL
+{
+    KEVENT      Event;
+    NTSTATUS    Status;
+    ULONG_PTR   Information;
+
+} MOUFILTER_SYNC_IOCTL, *PMOUFILTER_SYNC_IOCTL;
+
+//
+// The attributes the lower drivers last reported (see attrib.c)
+//
+#define MOUFILTER_ATTRIBUTES_TIMEOUT            1000    // milliseconds, unless configured
+#define MOUFILTER_ATTRIBUTES_MAXIMUM_TIMEOUT    30000
+
+typedef struct _MOUFILTER_ATTRIBUTES_CACHE
+{
+    //
+    // Guards Attributes, Valid and Generation
+    //
+    KSPIN_LOCK          Lock;
+    MOUSE_ATTRIBUTES    Attributes;
+    BOOLEAN             Valid;
+
+    //
+    // Bumped every time the cache is invalidated, so that an answer to a
+    // query sent before the change is not cached after it
+    //
+    ULONG               Generation;
+
+    //
+    // Asks the lower drivers again at PASSIVE_LEVEL.  RefreshQueued is set
+    // while the work item is queued or running, RefreshPending while a
+    // query has been asked for and not yet started.
+    //
+    PIO_WORKITEM        WorkItem;
+    LONG volatile       RefreshQueued;
+    LONG volatile       RefreshPending;
+
+} MOUFILTER_ATTRIBUTES_CACHE, *PMOUFILTER_ATTRIBUTES_CACHE;
+
+#if defined(_IA64_)
+#define MOUFILTER_CACHE_LINE    128
+#else
+#define MOUFILTER_CACHE_LINE    64
 #endif
 
+//
+// Motion packets held back from the class driver (see coalesce.c)
+//
+#define MOUFILTER_COALESCE_PACKETS          64
+#define MOUFILTER_COALESCE_COUNT            16      // packets, unless configured
+#define MOUFILTER_COALESCE_MAXIMUM_TIME     100000  // microseconds
+
+typedef struct _MOUFILTER_COALESCE
+{
+    struct _DEVICE_EXTENSION *DevExt;
+
+    //
+    // Guards everything below, and keeps the callback and the timer DPC
+    // from calling the class driver at the same time
+    //
+    KSPIN_LOCK          Lock;
+    KTIMER              Timer;
+    KDPC                TimerDpc;
+    BOOLEAN             TimerArmed;
+    ULONGLONG           FirstTime;          // interrupt time of Packets[0]
+    ULONG               Count;
+    MOUSE_INPUT_DATA    Packets[MOUFILTER_COALESCE_PACKETS];
+
+} MOUFILTER_COALESCE, *PMOUFILTER_COALESCE;
+
+//
+// Packets on their way from the service callback to the offload thread
+// (see offload.c).  Head is only written by the callback and Tail only by
+// the thread; both run freely and are masked to index Packets.
+//
+#define MOUFILTER_OFFLOAD_PACKETS   256     // a power of two
+
+typedef struct _MOUFILTER_OFFLOAD
+{
+    struct _DEVICE_EXTENSION *DevExt;
+    PKTHREAD            Thread;             // NULL if it could not be started
+    KEVENT              Wake;
+    KEVENT              Go;                 // no callback delivers inline any more
+    BOOLEAN volatile    Stop;
+
+    UCHAR               Padding0[MOUFILTER_CACHE_LINE];
+
+    LONG volatile       Head;
+    LONG volatile       Sleeping;           // the thread is about to wait on Wake
+
+    UCHAR               Padding1[MOUFILTER_CACHE_LINE];
+
+    LONG volatile       Tail;
+
+    UCHAR               Padding2[MOUFILTER_CACHE_LINE];
+
+    MOUSE_INPUT_DATA    Packets[MOUFILTER_OFFLOAD_PACKETS];
+
+} MOUFILTER_OFFLOAD, *PMOUFILTER_OFFLOAD;
+
+//
+// What the service callback counts while the device is open (see
+// activity.c)
+//
+typedef struct _MOUFILTER_ACTIVITY
+{
+    ULONGLONG   LastCallback;       // interrupt time
+    ULONG       BatchSize[MOUFILTR_HISTOGRAM_BUCKETS];
+    ULONG       Interval[MOUFILTR_HISTOGRAM_BUCKETS];
+    MOUFILTER_COALESCE  Coalesce;
+    MOUFILTER_OFFLOAD   Offload;
+
+} MOUFILTER_ACTIVITY, *PMOUFILTER_ACTIVITY;
+
+//
+// Readers of the pointers published to the service callback (see grace.c)
+//
+typedef struct _MOUFILTER_GRACE
+{
+    LONG volatile   Epoch;
+    LONG volatile   Readers[2];
+
+} MOUFILTER_GRACE, *PMOUFILTER_GRACE;
+
+//
+// A transform as the service callback applies it (see transform.c).  Never
+// changed once published.
+//
+typedef struct _MOUFILTER_TRANSFORM
+{
+    ULONG       Flags;
+    LONG        ScaleX;
+    LONG        ScaleY;
+    ULONG       AccelThreshold;
+    LONG        AccelScale;         // as it was set
+    LONG        AccelScaleX;        // ScaleX with the acceleration applied
+    LONG        AccelScaleY;
+
+} MOUFILTER_TRANSFORM, *PMOUFILTER_TRANSFORM;
+
+//
+// Anything published to the service callback.  They all come from one
+// lookaside list (see grace.c), so publishing never goes to the general
+// pool allocator once the list has warmed up.
+//
+typedef union _MOUFILTER_SNAPSHOT
+{
+    CONNECT_DATA        Connection;
+    MOUFILTER_TRANSFORM Transform;
+
+} MOUFILTER_SNAPSHOT, *PMOUFILTER_SNAPSHOT;
+
+//
+// FsContext of every handle open on the control device
+//
+typedef struct _MOUFILTER_FILE_CONTEXT
+{
+    LIST_ENTRY      Mappings;       // guarded by MouFilter_Globals.Lock
+
+} MOUFILTER_FILE_CONTEXT, *PMOUFILTER_FILE_CONTEXT;
+
+typedef struct _CONTROL_DEVICE_EXTENSION
+{
+    //
+    // Always MouFilterControlDevice; must be the first field
+    //
+    MOUFILTER_DEVICE_TYPE   Type;
+
+} CONTROL_DEVICE_EXTENSION, *PCONTROL_DEVICE_EXTENSION;
+
+//
+// State shared by every instance of the filter
+//
+typedef struct _MOUFILTER_GLOBALS
+{
+    //
+    // Guards everything below, and the mapping lists of every open handle.
+    // A mutex rather than a fast mutex, since device objects are created
+    // and deleted while holding it and that has to happen at PASSIVE_LEVEL.
+    //
+    KMUTEX          Lock;
+
+    LIST_ENTRY      DeviceList;     // DEVICE_EXTENSION.ListEntry
+    ULONG           DeviceCount;
+    ULONG           NextInstanceId;
+
+    //
+    // Exists whenever at least one filter device does
+    //
+    PDEVICE_OBJECT  ControlDeviceObject;
+
+    //
+    // Where snapshots come from, and how many are out; checked builds
+    // assert that they have all come back by the time the driver unloads
+    //
+    NPAGED_LOOKASIDE_LIST   SnapshotLookaside;
+    LONG                    SnapshotCount;
+
+} MOUFILTER_GLOBALS, *PMOUFILTER_GLOBALS;
+
+extern MOUFILTER_GLOBALS MouFilter_Globals;
+
+//
+// Packet times of one device (see clock.c), in 100ns units
+//
+#define MOUFILTER_CLOCK_SHIFT               4       // fraction bits of Interval
+#define MOUFILTER_CLOCK_MAXIMUM_INTERVAL    100000  // slower mice are not measured
+
+typedef struct _MOUFILTER_CLOCK
+{
+    ULONGLONG   Tick;               // interrupt time when it last moved on
+    ULONGLONG   Last;               // time given to the last packet
+    ULONG       Packets;            // packets since Tick
+    LONG        Interval;           // between packets, << MOUFILTER_CLOCK_SHIFT
+
+} MOUFILTER_CLOCK, *PMOUFILTER_CLOCK;
+
+extern ULONG MouFilter_ClockResolution;
+
+//
+// The counters behind IOCTL_MOUFILTR_GET_STATS, split by who writes them so
+// each can live with the rest of what that path touches (see
+// MouFilter_ControlGetStatsLocked)
+//
+typedef struct _MOUFILTER_PACKET_STATS
+{
+    ULONG       Callbacks;
+    ULONG       Packets;
+    ULONG       PacketsDropped;
+    ULONG       ClassServiceCalls;
+
+} MOUFILTER_PACKET_STATS, *PMOUFILTER_PACKET_STATS;
+
+typedef struct _MOUFILTER_IOCTL_STATS
+{
+    ULONG       AttributeQueriesCached;
+    ULONG       AttributeQueriesForwarded;
+    ULONG       Connects;
+    ULONG       Disconnects;
+
+} MOUFILTER_IOCTL_STATS, *PMOUFILTER_IOCTL_STATS;
+
+//
+// The device extension is laid out by who touches it.  The service callback
+// runs for every batch of packets, usually on whichever processor took the
+// interrupt, so the pointers it reads are kept away from anything the rest
+// of the driver writes, and the counters it writes are kept away from both.
+//
+// IoCreateDevice only promises pointer alignment for the extension, so the
+// groups cannot be aligned to a cache line; instead each is separated from
+// the next by a full line of padding, which keeps any two of them from ever
+// sharing one.  The C_ASSERTs below the structure hold the layout to that.
+//
 typedef struct _DEVICE_EXTENSION
 {
+    //
+    // Set up in MouFilter_AddDevice and never written again
+    //
+
+    //
+    // Always MouFilterFilterDevice; must be the first field
+    //
+    MOUFILTER_DEVICE_TYPE   Type;
+
     //
     // A backpointer to the device object for which this is the extension
     //
@@ -54,36 +523,127 @@ typedef struct _DEVICE_EXTENSION
     PDEVICE_OBJECT  TopOfStack;
 
     //
-    // Number of creates sent down
+    // The number user mode uses to pick this instance through the control
+    // device
     //
-    LONG EnableCount;
+    ULONG       InstanceId;
+
+    UCHAR       Padding0[MOUFILTER_CACHE_LINE];
+
+    //
+    // Read by the service callback on every call, written only when
+    // something is (re)configured.  Must fit in one cache line.
+    //
+
+    //
+    // The class driver this driver reports to, or NULL while it is
+    // disconnected.  Never changed in place (see connect.c).
+    //
+    PCONNECT_DATA volatile  UpperConnection;
+
+    //
+    // What to do to relative movement, or NULL to leave it alone
+    //
+    PMOUFILTER_TRANSFORM volatile   Transform;
+
+    //
+    // Packet tap; NULL until the first consumer maps it
+    //
+    PMOUFILTER_TAP  Tap;
+
+    //
+    // Batched reads; NULL until the first IOCTL_MOUFILTR_READ_BATCH
+    //
+    PMOUFILTER_BATCH    Batch;
+
+    //
+    // Histograms; NULL unless the device is open (see activity.c)
+    //
+    PMOUFILTER_ACTIVITY volatile    Activity;
+
+    //
+    // Set while a retired activity block still has packets to hand over
+    // (see activity.c); the callback drops packets meanwhile rather than
+    // let them overtake those
+    //
+    LONG volatile       ActivityRetiring;
+
+    //
+    // Interrupt time (100ns units) of the last successful start
+    //
+    ULONGLONG   StartTime;
+
+    UCHAR       Padding1[MOUFILTER_CACHE_LINE];
+
+    //
+    // Written by the service callback on every call
+    //
+
+    //
+    // Held by MouFilter_ServiceCallback while it runs, so that removal can
+    // wait for the port driver's last call before tearing anything down
+    //
+    EX_RUNDOWN_REF  CallbackRundown;
+
+    //
+    // Readers of UpperConnection, Transform and Activity (see grace.c)
+    //
+    MOUFILTER_GRACE         Grace;
+
+    //
+    // The fractions of a count the last scaling left over
+    //
+    LONG                    TransformRemainder[2];
+
+    //
+    // Whether the first packet after the last start has been reported yet
+    //
+    LONG        FirstPacketSeen;
+
+    //
+    // Timestamps for the packets (see clock.c)
+    //
+    MOUFILTER_CLOCK Clock;
+
+    //
+    // Packet counters for IOCTL_MOUFILTR_GET_STATS
+    //
+    MOUFILTER_PACKET_STATS  Stats;
+
+    UCHAR       Padding2[MOUFILTER_CACHE_LINE];
 
     //
-    // Previous hook routine and context
-    //                               
-    PVOID UpperContext;
-    //PI8042_MOUSE_ISR UpperIsrHook;
+    // Everything else belongs to PnP, power, the control device and our own
+    // requests, none of which the service callback looks at
+    //
+
+    //
+    // Number of creates sent down
+    //
+    LONG EnableCount;
 
     //
-    // Write to the mouse in the context of MouFilter_IsrHook
+    // Whether the port driver has been hooked to report to us
     //
-    //IN PI8042_ISR_WRITE_PORT IsrWritePort;
+    BOOLEAN                 PortConnected;
 
     //
-    // Context for IsrWritePort, QueueMousePacket
+    // Counters the internal IOCTL path bumps, interlocked, for
+    // IOCTL_MOUFILTR_GET_STATS
     //
-    IN PVOID CallContext;
+    MOUFILTER_IOCTL_STATS   IoctlStats;
 
     //
-    // Queue the current packet (ie the one passed into MouFilter_IsrHook)
-    // to be reported to the class driver
+    // Serializes everything that publishes a new snapshot for the service
+    // callback, and the grace periods the old snapshots wait out
     //
-    //IN PI8042_QUEUE_PACKET QueueMousePacket;
+    FAST_MUTEX              PublishLock;
 
     //
-    // The real connect data that this driver reports to
+    // Serializes MouFilter_ActivityUpdate as a whole, which has to stay at
+    // PASSIVE_LEVEL to start and stop the offload thread
     //
-    CONNECT_DATA UpperConnectData;
+    KMUTEX                  ActivityLock;
 
     //
     // current power state of the device
@@ -97,7 +657,95 @@ typedef struct _DEVICE_EXTENSION
     BOOLEAN SurpriseRemoved;
     BOOLEAN Removed;
 
-} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+    //
+    // Whether a profile has been picked for this mouse, or the chance to
+    // pick one by MouseIdentifier has passed
+    //
+    BOOLEAN ProfileResolved;
+
+    //
+    // Held across every IRP we forward to TopOfStack, so that
+    // IRP_MN_REMOVE_DEVICE can wait for them before detaching
+    //
+    IO_REMOVE_LOCK  RemoveLock;
+
+    //
+    // Our own requests to the lower drivers
+    //
+    MOUFILTER_IOCTL Ioctl;
+
+    //
+    // Answers IOCTL_MOUSE_QUERY_ATTRIBUTES without going down the stack
+    //
+    MOUFILTER_ATTRIBUTES_CACHE  AttributesCache;
+
+    //
+    // Interrupt time of AddDevice, so the debug output shows how long the
+    // mouse took to come up (along with StartTime and FirstPacketSeen)
+    //
+    ULONGLONG   AddTime;
+
+    //
+    // Our entry on MouFilter_Globals.DeviceList
+    //
+    LIST_ENTRY  ListEntry;
+
+} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+
+C_ASSERT(0 == FIELD_OFFSET(DEVICE_EXTENSION, Type));
+
+C_ASSERT(FIELD_OFFSET(DEVICE_EXTENSION, UpperConnection) -
+         RTL_SIZEOF_THROUGH_FIELD(DEVICE_EXTENSION, InstanceId) >= MOUFILTER_CACHE_LINE);
+C_ASSERT(RTL_SIZEOF_THROUGH_FIELD(DEVICE_EXTENSION, StartTime) -
+         FIELD_OFFSET(DEVICE_EXTENSION, UpperConnection) <= MOUFILTER_CACHE_LINE);
+
+C_ASSERT(FIELD_OFFSET(DEVICE_EXTENSION, CallbackRundown) -
+         RTL_SIZEOF_THROUGH_FIELD(DEVICE_EXTENSION, StartTime) >= MOUFILTER_CACHE_LINE);
+
+C_ASSERT(FIELD_OFFSET(DEVICE_EXTENSION, EnableCount) -
+         RTL_SIZEOF_THROUGH_FIELD(DEVICE_EXTENSION, Stats) >= MOUFILTER_CACHE_LINE);
+
+//
+// Settings read from the registry in DriverEntry (see config.c) and never
+// written again.  Kept on a cache line of its own, since the I/O paths
+// read it all the time.
+//
+#define MOUFILTER_CONFIG_CACHE_ATTRIBUTES   0x00000001  // answer attribute queries from the cache
+#define MOUFILTER_CONFIG_TRANSFORM          0x00000002  // new instances start with Transform
+#define MOUFILTER_CONFIG_OFFLOAD            0x00000004  // transform in the offload thread
+
+typedef struct DECLSPEC_ALIGN(MOUFILTER_CACHE_LINE) _MOUFILTER_CONFIG
+{
+    ULONG               Flags;
+    ULONG               AttributesTimeout;  // milliseconds
+    ULONG               CoalesceTime;       // microseconds, 0 when off
+    ULONG               CoalesceCount;      // packets
+    MOUFILTER_TRANSFORM Transform;
+
+} MOUFILTER_CONFIG, *PMOUFILTER_CONFIG;
+
+C_ASSERT(sizeof(MOUFILTER_CONFIG) == MOUFILTER_CACHE_LINE);
+
+extern MOUFILTER_CONFIG MouFilter_Config;
+
+//
+// Settings for one kind of mouse (see profile.c).  A profile is picked by
+// the hardware ID of the device or, failing that, by the MouseIdentifier
+// its port driver reports.  Profiles are loaded in DriverEntry and never
+// changed after that.
+//
+#define MOUFILTER_PROFILE_ID_LENGTH     200     // WCHARs, as MAX_DEVICE_ID_LEN
+
+typedef struct _MOUFILTER_PROFILE
+{
+    struct _MOUFILTER_PROFILE * Next;       // in its bucket, or on the identifier list
+    ULONG                       Hash;       // of HardwareId
+    ULONG                       MouseIdentifier;
+    MOUFILTER_TRANSFORM         Transform;
+    USHORT                      HardwareIdLength;   // WCHARs, 0 to match by identifier
+    WCHAR                       HardwareId[1];      // upper case, NUL terminated
+
+} MOUFILTER_PROFILE, *PMOUFILTER_PROFILE;
 
 //
 // Prototypes
@@ -127,12 +775,6 @@ MouFilter_InternIoCtl (
     IN PIRP Irp
     );
 
-NTSTATUS
-MouFilter_IoCtl (
-    IN PDEVICE_OBJECT DeviceObject,
-    IN PIRP Irp
-    );
-
 NTSTATUS
 MouFilter_PnP (
     IN PDEVICE_OBJECT DeviceObject,
@@ -153,6 +795,16 @@ MouFilter_ServiceCallback (
     IN OUT PULONG InputDataConsumed
     );
 
+VOID
+MouFilter_ServiceDeliver (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_ACTIVITY Activity OPTIONAL,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Now,
+    OUT PULONG InputDataConsumed
+    );
+
 VOID
 MouFilter_Unload (
     IN PDRIVER_OBJECT DriverObject
@@ -160,19 +812,477 @@ MouFilter_Unload (
 
 NTSTATUS
 MouFilter_MakeSynchronousIoctl ( 
-    IN PDEVICE_OBJECT    TopOfDeviceStack,
-    IN ULONG         IoctlControlCode,
-    PVOID             InputBuffer,
-    ULONG             InputBufferLength,
-    PVOID             OutputBuffer,
-    ULONG             OutputBufferLength
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG IoctlControlCode,
+    IN PVOID InputBuffer,
+    IN ULONG InputBufferLength,
+    OUT PVOID OutputBuffer,
+    IN ULONG OutputBufferLength,
+    IN ULONG TimeoutMs,
+    OUT PULONG_PTR Information OPTIONAL
+    );
+
+NTSTATUS
+MouFilter_MakeAsynchronousIoctl (
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG IoctlControlCode,
+    IN PVOID InputBuffer,
+    IN ULONG InputBufferLength,
+    OUT PVOID OutputBuffer,
+    IN ULONG OutputBufferLength,
+    IN ULONG TimeoutMs,
+    IN PMOUFILTER_IOCTL_CALLBACK Callback,
+    IN PVOID Context
+    );
+
+NTSTATUS
+MouFilter_IoctlComplete (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+    );
+
+VOID
+MouFilter_IoctlTimerDpc (
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    );
+
+VOID
+MouFilter_IoctlFinish (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+MouFilter_SynchronousIoctlDone (
+    IN PDEVICE_EXTENSION DevExt,
+    IN NTSTATUS Status,
+    IN ULONG_PTR Information,
+    IN PVOID Context
     );
 
 VOID
 MouFilter_QueryMouseAttributes (
-	IN PDEVICE_OBJECT    TopOfDeviceStack
+	IN PDEVICE_EXTENSION DevExt
 	);
 
+NTSTATUS
+MouFilter_StartComplete (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+    );
+
+VOID
+MouFilter_TraceIrp (
+    IN PCSTR Caller,
+    IN PIO_STACK_LOCATION IrpStack
+    );
+
+//
+// control.c
+//
+
+VOID
+MouFilter_RegisterDevice (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+MouFilter_DeregisterDevice (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+PDEVICE_EXTENSION
+MouFilter_FindDeviceLocked (
+    IN ULONG InstanceId
+    );
+
+VOID
+MouFilter_AcquireGlobalLock (
+    VOID
+    );
+
+VOID
+MouFilter_ReleaseGlobalLock (
+    VOID
+    );
+
+NTSTATUS
+MouFilter_ControlDispatch (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    );
+
+//
+// tap.c
+//
+
+VOID
+MouFilter_TapPublish (
+    IN PMOUFILTER_TAP Tap,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Timestamp,
+    IN ULONG Spacing
+    );
+
+VOID
+MouFilter_TapRelease (
+    IN PMOUFILTER_TAP Tap
+    );
+
+NTSTATUS
+MouFilter_TapMap (
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN PMOUFILTR_MAP_TAP_INPUT Input,
+    IN KPROCESSOR_MODE RequestorMode,
+    OUT PMOUFILTR_MAP_TAP_OUTPUT Output
+    );
+
+NTSTATUS
+MouFilter_TapUnmap (
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN ULONG InstanceId
+    );
+
+VOID
+MouFilter_TapUnmapAll (
+    IN PMOUFILTER_FILE_CONTEXT FileContext
+    );
+
+//
+// batch.c
+//
+
+VOID
+MouFilter_BatchAppend (
+    IN PMOUFILTER_BATCH Batch,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    );
+
+NTSTATUS
+MouFilter_BatchRead (
+    IN PIRP Irp,
+    IN PMOUFILTR_READ_BATCH_INPUT Input
+    );
+
+VOID
+MouFilter_BatchCancelFile (
+    IN PFILE_OBJECT FileObject
+    );
+
+VOID
+MouFilter_BatchDestroy (
+    IN PMOUFILTER_BATCH Batch
+    );
+
+//
+// attrib.c
+//
+
+NTSTATUS
+MouFilter_AttributesInit (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+ULONG
+MouFilter_AttributesInvalidate (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+BOOLEAN
+MouFilter_AttributesStore (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUSE_ATTRIBUTES Attributes,
+    IN ULONG Generation
+    );
+
+BOOLEAN
+MouFilter_AttributesLookup (
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PMOUSE_ATTRIBUTES Attributes
+    );
+
+VOID
+MouFilter_AttributesRefresh (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+//
+// grace.c
+//
+
+ULONG
+MouFilter_GraceEnter (
+    IN PMOUFILTER_GRACE Grace
+    );
+
+VOID
+MouFilter_GraceLeave (
+    IN PMOUFILTER_GRACE Grace,
+    IN ULONG Slot
+    );
+
+VOID
+MouFilter_GraceWait (
+    IN PMOUFILTER_GRACE Grace
+    );
+
+PVOID
+MouFilter_SnapshotAllocate (
+    VOID
+    );
+
+VOID
+MouFilter_SnapshotFree (
+    IN PVOID Snapshot
+    );
+
+//
+// connect.c
+//
+
+NTSTATUS
+MouFilter_ConnectPublish (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PCONNECT_DATA ConnectData
+    );
+
+NTSTATUS
+MouFilter_ConnectComplete (
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp,
+    IN PVOID Context
+    );
+
+//
+// transform.c
+//
+
+NTSTATUS
+MouFilter_TransformPublishCopy (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Compiled
+    );
+
+NTSTATUS
+MouFilter_TransformCompile (
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Input,
+    OUT PMOUFILTER_TRANSFORM Transform
+    );
+
+BOOLEAN
+MouFilter_TransformIsIdentity (
+    IN PMOUFILTER_TRANSFORM Transform
+    );
+
+VOID
+MouFilter_TransformApply (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Transform,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    );
+
+NTSTATUS
+MouFilter_TransformPublish (
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Transform
+    );
+
+NTSTATUS
+MouFilter_TransformSet (
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Input
+    );
+
+NTSTATUS
+MouFilter_TransformGet (
+    IN ULONG InstanceId,
+    OUT PMOUFILTR_SET_TRANSFORM_INPUT Output
+    );
+
+//
+// config.c
+//
+
+NTSTATUS
+MouFilter_ConfigQueryValue (
+    IN PWSTR ValueName,
+    IN ULONG ValueType,
+    IN PVOID ValueData,
+    IN ULONG ValueLength,
+    IN PVOID Context,
+    IN PVOID EntryContext
+    );
+
+VOID
+MouFilter_ConfigReadTransform (
+    IN ULONG RelativeTo,
+    IN PWSTR Path,
+    IN PWSTR Subkey OPTIONAL,
+    IN OUT PMOUFILTR_SET_TRANSFORM_INPUT Input
+    );
+
+VOID
+MouFilter_ConfigLoad (
+    IN PUNICODE_STRING RegistryPath
+    );
+
+NTSTATUS
+MouFilter_ConfigApply (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+//
+// activity.c
+//
+
+VOID
+MouFilter_ActivityRecord (
+    IN PMOUFILTER_ACTIVITY Activity,
+    IN ULONG Packets,
+    IN ULONGLONG Now
+    );
+
+VOID
+MouFilter_ActivityUpdate (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+NTSTATUS
+MouFilter_ActivityGet (
+    IN ULONG InstanceId,
+    OUT PMOUFILTR_HISTOGRAM Histogram
+    );
+
+//
+// clock.c
+//
+
+VOID
+MouFilter_ClockInit (
+    VOID
+    );
+
+ULONGLONG
+MouFilter_ClockBatch (
+    IN PMOUFILTER_CLOCK Clock,
+    IN ULONG Packets,
+    IN ULONGLONG Now,
+    OUT PULONG Spacing
+    );
+
+//
+// coalesce.c
+//
+
+VOID
+MouFilter_CoalesceReport (
+    IN PMOUFILTER_COALESCE Coalesce,
+    IN PCONNECT_DATA Connection,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Now
+    );
+
+VOID
+MouFilter_CoalesceStart (
+    IN PMOUFILTER_COALESCE Coalesce,
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+MouFilter_CoalesceStop (
+    IN PMOUFILTER_COALESCE Coalesce
+    );
+
+//
+// offload.c
+//
+
+VOID
+MouFilter_OffloadReport (
+    IN PMOUFILTER_OFFLOAD Offload,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    );
+
+NTSTATUS
+MouFilter_OffloadStart (
+    IN PMOUFILTER_OFFLOAD Offload,
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+MouFilter_OffloadGo (
+    IN PMOUFILTER_OFFLOAD Offload
+    );
+
+VOID
+MouFilter_OffloadStop (
+    IN PMOUFILTER_OFFLOAD Offload
+    );
+
+//
+// profile.c
+//
+
+VOID
+MouFilter_ProfileLoad (
+    IN PUNICODE_STRING RegistryPath
+    );
+
+VOID
+MouFilter_ProfileUnload (
+    VOID
+    );
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileFindHardwareId (
+    IN PDEVICE_OBJECT PDO
+    );
+
+VOID
+MouFilter_ProfileApplyIdentifier (
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG MouseIdentifier
+    );
+
+#if DBG
+
+//
+// pool.c
+//
+
+extern ULONG MouFilter_PoolFlags;
+
+VOID
+MouFilter_PoolInit (
+    VOID
+    );
+
+PVOID
+MouFilter_AllocatePool (
+    IN POOL_TYPE PoolType,
+    IN SIZE_T Size
+    );
+
+VOID
+MouFilter_FreePool (
+    IN PVOID Block
+    );
+
+VOID
+MouFilter_PoolReport (
+    VOID
+    );
+
+#endif  // DBG
+
 #endif  // MOUFILTER_H
 
 
@@ -0,0 +1,347 @@
+/*++
+
+Offloading: with Offload set in the Parameters key (see config.c), the
+service callback stops at the cheap stages (tap, batched reads, counters)
+and leaves the transform and the call into the class driver to a thread
+of the mouse's own.  Whatever runs in that thread runs at PASSIVE_LEVEL,
+so stages too slow for the port driver's DPC can go in
+MouFilter_OffloadDeliver without holding up the other devices on that
+processor.
+
+The callback and the thread share a ring of packets.  The callback is
+the only one that adds packets and the thread the only one that takes
+them, so each index has one writer and no lock is needed; the indices sit
+on cache lines of their own so the two processors do not fight over
+them.  A full ring drops the new packets, since the port driver was
+already told they were consumed.
+
+The ring and the thread are part of the activity block (see activity.c):
+started before the first open publishes it (but kept off the ring until
+callbacks that missed the block are done) and stopped after the last
+close has taken it away.  Packets still in the ring then go out as usual,
+and the callback drops new ones until they have.
+
+File: offload.c
+
+--*/
+
+#include "moufiltr.h"
+
+VOID
+MouFilter_OffloadThread (
+    IN PVOID Context
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_OffloadStart)
+#pragma alloc_text (PAGE, MouFilter_OffloadGo)
+#pragma alloc_text (PAGE, MouFilter_OffloadStop)
+#endif
+
+VOID
+MouFilter_OffloadReport(
+    IN PMOUFILTER_OFFLOAD Offload,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    )
+/*++
+Routine Description:
+
+    Adds the packets of one service callback to the ring.  Called at
+    DISPATCH_LEVEL inside the grace period section; the caller reports
+    every packet as consumed.
+
+--*/
+{
+    ULONG   head;
+    ULONG   room;
+    ULONG   count;
+    ULONG   index;
+
+    head = (ULONG) Offload->Head;
+    room = MOUFILTER_OFFLOAD_PACKETS - (head - (ULONG) Offload->Tail);
+    count = (ULONG) (InputDataEnd - InputDataStart);
+
+    if (count > room) {
+        InterlockedExchangeAdd((PLONG) &Offload->DevExt->Stats.PacketsDropped, (LONG) (count - room));
+        count = room;
+    }
+
+    if (0 == count) {
+        return;
+    }
+
+    for (index = 0; index < count; index++) {
+        Offload->Packets[(head + index) & (MOUFILTER_OFFLOAD_PACKETS - 1)] = InputDataStart[index];
+    }
+
+    //
+    // The exchange is a full barrier, so the thread never sees the new
+    // head before the packets behind it
+    //
+    InterlockedExchange(&Offload->Head, (LONG) (head + count));
+
+    //
+    // Only wake the thread if it went to sleep; it sets Sleeping before it
+    // looks at the head for the last time, so one of the two sees the other
+    //
+    if (0 != Offload->Sleeping && 0 != InterlockedExchange(&Offload->Sleeping, 0)) {
+        KeSetEvent(&Offload->Wake, IO_MOUSE_INCREMENT, FALSE);
+    }
+}
+
+VOID
+MouFilter_OffloadDeliver(
+    IN PMOUFILTER_OFFLOAD Offload,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    )
+/*++
+Routine Description:
+
+    Does for packets from the ring what the service callback does for the
+    others once it has counted them.  Called at PASSIVE_LEVEL in the
+    offload thread.
+
+--*/
+{
+    PDEVICE_EXTENSION       devExt = Offload->DevExt;
+    PMOUFILTER_TRANSFORM    transform;
+    KIRQL                   oldIrql;
+    ULONG                   slot;
+    ULONG                   consumed;
+    ULONG                   count;
+
+    count = (ULONG) (InputDataEnd - InputDataStart);
+
+    //
+    // The ring belongs to the activity block, which is only freed once this
+    // thread is gone, so the grace period section only has to cover the
+    // transform and the connection
+    //
+    slot = MouFilter_GraceEnter(&devExt->Grace);
+
+    transform = devExt->Transform;
+    if (NULL != transform) {
+        MouFilter_TransformApply(devExt, transform, InputDataStart, InputDataEnd);
+    }
+
+    //
+    // The class driver expects to be called at DISPATCH_LEVEL
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    MouFilter_ServiceDeliver(devExt,
+                             CONTAINING_RECORD(Offload, MOUFILTER_ACTIVITY, Offload),
+                             InputDataStart,
+                             InputDataEnd,
+                             KeQueryInterruptTime(),
+                             &consumed);
+
+    KeLowerIrql(oldIrql);
+
+    MouFilter_GraceLeave(&devExt->Grace, slot);
+
+    //
+    // Nobody to hand the rest back to
+    //
+    if (consumed < count) {
+        InterlockedExchangeAdd((PLONG) &devExt->Stats.PacketsDropped, (LONG) (count - consumed));
+    }
+}
+
+VOID
+MouFilter_OffloadThread(
+    IN PVOID Context
+    )
+{
+    PMOUFILTER_OFFLOAD  offload = (PMOUFILTER_OFFLOAD) Context;
+    ULONG               head;
+    ULONG               tail;
+    ULONG               first;
+    ULONG               count;
+
+    //
+    // Mouse input should not wait behind ordinary threads
+    //
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    //
+    // Callbacks that found no activity block may still be applying the
+    // transform themselves; the packets they hand over wait in the ring
+    // until those are done
+    //
+    KeWaitForSingleObject(&offload->Go, Executive, KernelMode, FALSE, NULL);
+
+    for (;;) {
+        head = (ULONG) offload->Head;
+        tail = (ULONG) offload->Tail;
+
+        if (head == tail) {
+            //
+            // Stop is only set once the callback can no longer add packets,
+            // so an empty ring stays empty
+            //
+            if (offload->Stop) {
+                break;
+            }
+
+            InterlockedExchange(&offload->Sleeping, 1);
+
+            if ((ULONG) offload->Head == tail && !offload->Stop) {
+                KeWaitForSingleObject(&offload->Wake, Executive, KernelMode, FALSE, NULL);
+            }
+
+            InterlockedExchange(&offload->Sleeping, 0);
+            continue;
+        }
+
+        //
+        // As much as is in one piece; the rest comes round next time
+        //
+        first = tail & (MOUFILTER_OFFLOAD_PACKETS - 1);
+        count = head - tail;
+        if (count > MOUFILTER_OFFLOAD_PACKETS - first) {
+            count = MOUFILTER_OFFLOAD_PACKETS - first;
+        }
+
+        MouFilter_OffloadDeliver(offload,
+                                 offload->Packets + first,
+                                 offload->Packets + first + count);
+
+        //
+        // Hands the slots back to the callback
+        //
+        InterlockedExchange(&offload->Tail, (LONG) (tail + count));
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+MouFilter_OffloadStart(
+    IN PMOUFILTER_OFFLOAD Offload,
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Starts the thread of a new activity block, before it is published.
+    Called at PASSIVE_LEVEL.  On failure the block is still usable; the
+    callback sees Thread is NULL and does everything itself.
+
+--*/
+{
+    OBJECT_ATTRIBUTES   attributes;
+    HANDLE              handle;
+    NTSTATUS            status;
+
+    PAGED_CODE();
+
+    Offload->DevExt = DevExt;
+    KeInitializeEvent(&Offload->Wake, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Offload->Go, NotificationEvent, FALSE);
+
+    //
+    // We run in whatever process opened the mouse (csrss, usually), so the
+    // handle must not land in its handle table
+    //
+    InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = PsCreateSystemThread(&handle,
+                                  THREAD_ALL_ACCESS,
+                                  &attributes,
+                                  NULL,
+                                  NULL,
+                                  MouFilter_OffloadThread,
+                                  Offload);
+
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_OffloadStart() could not start the thread (0x%08x)\n", status);
+        return status;
+    }
+
+    //
+    // Keep the thread object to wait on when stopping; the handle itself is
+    // of no use to us
+    //
+    status = ObReferenceObjectByHandle(handle,
+                                       THREAD_ALL_ACCESS,
+                                       NULL,
+                                       KernelMode,
+                                       (PVOID *) &Offload->Thread,
+                                       NULL);
+
+    //
+    // Cannot fail for a handle we just got.  If it does anyway, the thread
+    // is already running against Offload and must be gone before the
+    // block can be freed; the handle is all there is to wait on.  It has
+    // never been given packets, so it exits as soon as it sees Stop.
+    //
+    ASSERT(NT_SUCCESS(status));
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_OffloadStart() could not reference the thread (0x%08x)\n", status);
+
+        Offload->Stop = TRUE;
+        KeSetEvent(&Offload->Go, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(handle, FALSE, NULL);
+
+        Offload->Thread = NULL;
+    }
+
+    ZwClose(handle);
+
+    return status;
+}
+
+VOID
+MouFilter_OffloadGo(
+    IN PMOUFILTER_OFFLOAD Offload
+    )
+/*++
+Routine Description:
+
+    Lets the thread of a published activity block start on the ring, once
+    the grace period after publishing it is over: from then on only the
+    thread applies the transform and calls the class driver.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (NULL == Offload->Thread) {
+        return;
+    }
+
+    KeSetEvent(&Offload->Go, IO_NO_INCREMENT, FALSE);
+}
+
+VOID
+MouFilter_OffloadStop(
+    IN PMOUFILTER_OFFLOAD Offload
+    )
+/*++
+Routine Description:
+
+    Called once the activity block is no longer published and the grace
+    period is over, so the callback can no longer add packets; until
+    MouFilter_ActivityUpdate is done with the block, the callback drops
+    them rather than overtake those still in the ring.  Returns after the
+    thread has sent what is left in the ring and exited.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (NULL == Offload->Thread) {
+        return;
+    }
+
+    Offload->Stop = TRUE;
+    KeSetEvent(&Offload->Go, IO_NO_INCREMENT, FALSE);
+    KeSetEvent(&Offload->Wake, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(Offload->Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Offload->Thread);
+    Offload->Thread = NULL;
+}
@@ -0,0 +1,223 @@
+/*++
+
+Checked-build pool wrappers.  In checked builds ExAllocatePool and
+ExFreePool (see moufiltr.h) come here, so that a block the driver
+overruns or frees twice is caught on the spot.  Without this we only
+hear about it later, as a BAD_POOL_HEADER bugcheck in somebody else's
+free (debug2.txt is one of those).
+
+Every block gets a header and a trailer that are checked when it is
+freed.  The live blocks and bytes under MOUFILTER_POOL_TAG are counted,
+and MouFilter_PoolReport prints them when the driver unloads.  That
+much is cheap enough to leave on all the time.  Setting
+MOUFILTER_POOL_TRACK in MouFilter_PoolFlags from the debugger also keeps
+every live block on a list, so the report can name each leaked block,
+and fills freed blocks so later use of them stands out.
+
+Free builds call the pool directly and compile none of this.  Driver
+Verifier's special pool is still the tool for catching overruns at the
+faulting instruction.
+
+File: pool.c
+
+--*/
+
+#include "moufiltr.h"
+
+#if DBG
+
+#undef ExAllocatePool
+#undef ExFreePool
+
+#define MOUFILTER_POOL_MAGIC        0x6c6f6f50      // 'Pool'
+#define MOUFILTER_POOL_MAGIC_FREED  0x65657246      // 'Free'
+#define MOUFILTER_POOL_FILL         0xFD            // red zones
+#define MOUFILTER_POOL_FILL_FREED   0xFB
+#define MOUFILTER_POOL_TRAILER      16
+
+//
+// Sits in front of every block.  Whatever the fields leave of it is red
+// zone; the size keeps the caller's block aligned on every platform.
+//
+typedef union _MOUFILTER_POOL_HEADER
+{
+    struct {
+        LIST_ENTRY  ListEntry;      // on MouFilter_Pool.Blocks, if tracked
+        SIZE_T      Size;           // what the caller asked for
+        ULONG       Magic;
+        ULONG       Tracked;
+    } s;
+
+    UCHAR           Bytes[48];
+
+} MOUFILTER_POOL_HEADER, *PMOUFILTER_POOL_HEADER;
+
+C_ASSERT(sizeof(MOUFILTER_POOL_HEADER) % 16 == 0);
+
+#define MOUFILTER_POOL_REDZONE_OFFSET   (FIELD_OFFSET(MOUFILTER_POOL_HEADER, s.Tracked) + sizeof(ULONG))
+
+ULONG MouFilter_PoolFlags = 0;
+
+struct {
+    KSPIN_LOCK      Lock;           // guards Blocks
+    LIST_ENTRY      Blocks;
+    LONG            LiveBlocks;
+    LONG            LiveBytes;
+    LONG            PeakBytes;
+} MouFilter_Pool;
+
+VOID
+MouFilter_PoolInit(
+    VOID
+    )
+{
+    KeInitializeSpinLock(&MouFilter_Pool.Lock);
+    InitializeListHead(&MouFilter_Pool.Blocks);
+}
+
+BOOLEAN
+MouFilter_PoolCheckFill(
+    IN PUCHAR Bytes,
+    IN SIZE_T Length
+    )
+{
+    SIZE_T i;
+
+    for (i = 0; i < Length; i++) {
+        if (MOUFILTER_POOL_FILL != Bytes[i]) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+PVOID
+MouFilter_AllocatePool(
+    IN POOL_TYPE PoolType,
+    IN SIZE_T Size
+    )
+{
+    PMOUFILTER_POOL_HEADER  header;
+    PUCHAR                  block;
+    LONG                    bytes;
+    LONG                    peak;
+    KIRQL                   oldIrql;
+
+    header = (PMOUFILTER_POOL_HEADER)
+        ExAllocatePoolWithTag(PoolType,
+                              sizeof(MOUFILTER_POOL_HEADER) + Size + MOUFILTER_POOL_TRAILER,
+                              MOUFILTER_POOL_TAG);
+    if (NULL == header) {
+        return NULL;
+    }
+
+    RtlFillMemory(header, sizeof(MOUFILTER_POOL_HEADER), MOUFILTER_POOL_FILL);
+    header->s.Size = Size;
+    header->s.Magic = MOUFILTER_POOL_MAGIC;
+    header->s.Tracked = FALSE;
+
+    block = (PUCHAR) (header + 1);
+    RtlFillMemory(block + Size, MOUFILTER_POOL_TRAILER, MOUFILTER_POOL_FILL);
+
+    InterlockedIncrement(&MouFilter_Pool.LiveBlocks);
+    bytes = InterlockedExchangeAdd(&MouFilter_Pool.LiveBytes, (LONG) Size) + (LONG) Size;
+
+    peak = MouFilter_Pool.PeakBytes;
+    while (bytes > peak &&
+           peak != InterlockedCompareExchange(&MouFilter_Pool.PeakBytes, bytes, peak)) {
+        peak = MouFilter_Pool.PeakBytes;
+    }
+
+    if (MouFilter_PoolFlags & MOUFILTER_POOL_TRACK) {
+        header->s.Tracked = TRUE;
+        KeAcquireSpinLock(&MouFilter_Pool.Lock, &oldIrql);
+        InsertTailList(&MouFilter_Pool.Blocks, &header->s.ListEntry);
+        KeReleaseSpinLock(&MouFilter_Pool.Lock, oldIrql);
+    }
+
+    return block;
+}
+
+VOID
+MouFilter_FreePool(
+    IN PVOID Block
+    )
+{
+    PMOUFILTER_POOL_HEADER  header;
+    SIZE_T                  size;
+    KIRQL                   oldIrql;
+
+    header = ((PMOUFILTER_POOL_HEADER) Block) - 1;
+
+    if (MOUFILTER_POOL_MAGIC != header->s.Magic) {
+        DbgPrint("MouFilter_FreePool() %p: %s\n", Block,
+                 MOUFILTER_POOL_MAGIC_FREED == header->s.Magic ?
+                     "freed twice" : "not ours, or its header was overwritten");
+        TRAP();
+        return;
+    }
+
+    size = header->s.Size;
+
+    if (!MouFilter_PoolCheckFill(header->Bytes + MOUFILTER_POOL_REDZONE_OFFSET,
+                                 sizeof(MOUFILTER_POOL_HEADER) - MOUFILTER_POOL_REDZONE_OFFSET)) {
+        DbgPrint("MouFilter_FreePool() %p: written in front of the block\n", Block);
+        TRAP();
+    }
+
+    if (!MouFilter_PoolCheckFill((PUCHAR) Block + size, MOUFILTER_POOL_TRAILER)) {
+        DbgPrint("MouFilter_FreePool() %p: written past the end of its %lu bytes\n",
+                 Block, (ULONG) size);
+        TRAP();
+    }
+
+    if (header->s.Tracked) {
+        KeAcquireSpinLock(&MouFilter_Pool.Lock, &oldIrql);
+        RemoveEntryList(&header->s.ListEntry);
+        KeReleaseSpinLock(&MouFilter_Pool.Lock, oldIrql);
+
+        RtlFillMemory(Block, size, MOUFILTER_POOL_FILL_FREED);
+    }
+
+    header->s.Magic = MOUFILTER_POOL_MAGIC_FREED;
+
+    InterlockedDecrement(&MouFilter_Pool.LiveBlocks);
+    InterlockedExchangeAdd(&MouFilter_Pool.LiveBytes, -(LONG) size);
+
+    ExFreePoolWithTag(header, MOUFILTER_POOL_TAG);
+}
+
+VOID
+MouFilter_PoolReport(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Called from MouFilter_Unload.  By then everything the driver allocated
+    should have been freed.
+
+--*/
+{
+    PLIST_ENTRY             entry;
+    PMOUFILTER_POOL_HEADER  header;
+    ULONG                   tag = MOUFILTER_POOL_TAG;
+
+    DbgPrint("MouFilter_PoolReport() '%4.4s': %ld blocks, %ld bytes live; peak %ld bytes\n",
+             (PCHAR) &tag,
+             MouFilter_Pool.LiveBlocks, MouFilter_Pool.LiveBytes, MouFilter_Pool.PeakBytes);
+
+    for (entry = MouFilter_Pool.Blocks.Flink;
+         entry != &MouFilter_Pool.Blocks;
+         entry = entry->Flink) {
+
+        header = CONTAINING_RECORD(entry, MOUFILTER_POOL_HEADER, s.ListEntry);
+        DbgPrint("MouFilter_PoolReport() leaked %p, %lu bytes\n",
+                 header + 1, (ULONG) header->s.Size);
+    }
+
+    ASSERT(0 == MouFilter_Pool.LiveBlocks);
+}
+
+#endif  // DBG
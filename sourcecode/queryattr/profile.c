@@ -0,0 +1,556 @@
+/*++
+
+Profiles: settings for one kind of mouse, for machines that mix PS/2, HID
+and virtual mice on one image.  Each profile is a subkey (any name) of
+Parameters\Profiles under the service key, holding
+
+    HardwareId          REG_SZ, one of the hardware IDs of the mouse, for
+                        instance HID\VID_046D&PID_C077 or *PNP0F13
+    MouseIdentifier     REG_DWORD, used only when there is no HardwareId:
+                        the MouseIdentifier the port driver reports in
+                        MOUSE_ATTRIBUTES (MOUSE_HID_HARDWARE and so on)
+
+and the same transform values as the Parameters key (see config.c).  What
+a profile leaves out comes from the Parameters key.
+
+The profiles are read once, in DriverEntry, into a hash table keyed by the
+upper case hardware ID.  MouFilter_AddDevice looks up the hardware IDs of
+the new device, most specific first, and the instance starts with the
+transform of the first profile found.  If none is found, the MouseIdentifier
+is tried once the attributes have been queried after the first start.  The
+service callback never sees any of this; it only gets the transform.
+
+File: profile.c
+
+--*/
+
+#include "moufiltr.h"
+
+typedef struct _MOUFILTER_PROFILES
+{
+    PMOUFILTER_PROFILE *    Buckets;        // BucketMask + 1 of them
+    ULONG                   BucketMask;
+    ULONG                   Count;
+
+    //
+    // Profiles matched by MouseIdentifier; there are only a handful of
+    // those values, so a list does
+    //
+    PMOUFILTER_PROFILE      Identifiers;
+
+} MOUFILTER_PROFILES;
+
+MOUFILTER_PROFILES MouFilter_Profiles;
+
+ULONG
+MouFilter_ProfileHash (
+    IN PCWSTR Id,
+    IN ULONG Length
+    );
+
+NTSTATUS
+MouFilter_ProfileQueryString (
+    IN PWSTR ValueName,
+    IN ULONG ValueType,
+    IN PVOID ValueData,
+    IN ULONG ValueLength,
+    IN PVOID Context,
+    IN PVOID EntryContext
+    );
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileRead (
+    IN HANDLE Key,
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Defaults
+    );
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileFind (
+    IN PCWSTR Id,
+    IN ULONG Length
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, MouFilter_ProfileLoad)
+#pragma alloc_text (INIT, MouFilter_ProfileQueryString)
+#pragma alloc_text (INIT, MouFilter_ProfileRead)
+#pragma alloc_text (PAGE, MouFilter_ProfileUnload)
+#pragma alloc_text (PAGE, MouFilter_ProfileHash)
+#pragma alloc_text (PAGE, MouFilter_ProfileFind)
+#pragma alloc_text (PAGE, MouFilter_ProfileFindHardwareId)
+#pragma alloc_text (PAGE, MouFilter_ProfileApplyIdentifier)
+#endif
+
+ULONG
+MouFilter_ProfileHash(
+    IN PCWSTR Id,
+    IN ULONG Length
+    )
+/*++
+Routine Description:
+
+    FNV-1a over the upper case characters, so that hardware IDs that only
+    differ in case land in the same bucket.
+
+--*/
+{
+    ULONG   hash = 2166136261;
+    ULONG   i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < Length; i++) {
+        hash = (hash ^ RtlUpcaseUnicodeChar(Id[i])) * 16777619;
+    }
+
+    return hash;
+}
+
+NTSTATUS
+MouFilter_ProfileQueryString(
+    IN PWSTR ValueName,
+    IN ULONG ValueType,
+    IN PVOID ValueData,
+    IN ULONG ValueLength,
+    IN PVOID Context,
+    IN PVOID EntryContext
+    )
+/*++
+Routine Description:
+
+    Copies the HardwareId of a profile into the MOUFILTER_PROFILE_ID_LENGTH
+    buffer EntryContext points to.  Anything but a REG_SZ that fits is
+    ignored.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    if (REG_SZ != ValueType ||
+        ValueLength < sizeof(WCHAR) ||
+        ValueLength > MOUFILTER_PROFILE_ID_LENGTH * sizeof(WCHAR)) {
+
+        DbgPrint("MouFilter_ProfileQueryString() ignoring %ws, not a REG_SZ hardware ID\n", ValueName);
+        return STATUS_SUCCESS;
+    }
+
+    RtlCopyMemory(EntryContext, ValueData, ValueLength);
+    ((PWCHAR) EntryContext)[ValueLength / sizeof(WCHAR) - 1] = UNICODE_NULL;
+
+    return STATUS_SUCCESS;
+}
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileRead(
+    IN HANDLE Key,
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Defaults
+    )
+/*++
+Routine Description:
+
+    Reads one profile subkey.  Returns NULL if it matches nothing or its
+    transform is out of range.
+
+--*/
+{
+    RTL_QUERY_REGISTRY_TABLE        table[3];
+    MOUFILTR_SET_TRANSFORM_INPUT    input;
+    MOUFILTER_TRANSFORM             transform;
+    PMOUFILTER_PROFILE              profile;
+    WCHAR                           hardwareId[MOUFILTER_PROFILE_ID_LENGTH];
+    ULONG                           mouseIdentifier = 0;
+    ULONG                           length;
+    ULONG                           i;
+    NTSTATUS                        status;
+
+    hardwareId[0] = UNICODE_NULL;
+
+    RtlZeroMemory(table, sizeof(table));
+
+    table[0].QueryRoutine = MouFilter_ProfileQueryString;
+    table[0].Name = L"HardwareId";
+    table[0].EntryContext = hardwareId;
+
+    table[1].QueryRoutine = MouFilter_ConfigQueryValue;
+    table[1].Name = L"MouseIdentifier";
+    table[1].EntryContext = &mouseIdentifier;
+
+    status = RtlQueryRegistryValues(RTL_REGISTRY_HANDLE, (PWSTR) Key, table, NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        return NULL;
+    }
+
+    for (length = 0; UNICODE_NULL != hardwareId[length]; length++) {
+        ;
+    }
+
+    if (0 == length && 0 == mouseIdentifier) {
+        DbgPrint("MouFilter_ProfileRead() profile has neither HardwareId nor MouseIdentifier\n");
+        return NULL;
+    }
+
+    input = *Defaults;
+    MouFilter_ConfigReadTransform(RTL_REGISTRY_HANDLE, (PWSTR) Key, NULL, &input);
+
+    status = MouFilter_TransformCompile(&input, &transform);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_ProfileRead() ignoring the profile for %ws, transform out of range\n",
+                 hardwareId);
+        return NULL;
+    }
+
+    profile = (PMOUFILTER_PROFILE)
+        ExAllocatePool(PagedPool, sizeof(MOUFILTER_PROFILE) + length * sizeof(WCHAR));
+    if (NULL == profile) {
+        return NULL;
+    }
+
+    for (i = 0; i < length; i++) {
+        profile->HardwareId[i] = RtlUpcaseUnicodeChar(hardwareId[i]);
+    }
+    profile->HardwareId[length] = UNICODE_NULL;
+    profile->HardwareIdLength = (USHORT) length;
+    profile->Hash = MouFilter_ProfileHash(profile->HardwareId, length);
+    profile->MouseIdentifier = mouseIdentifier;
+    profile->Transform = transform;
+    profile->Next = NULL;
+
+    return profile;
+}
+
+VOID
+MouFilter_ProfileLoad(
+    IN PUNICODE_STRING RegistryPath
+    )
+/*++
+Routine Description:
+
+    Called from MouFilter_ConfigLoad, once the Parameters key has been read,
+    since that is what profiles start from.  Without a Profiles key there
+    is nothing to do.
+
+--*/
+{
+    OBJECT_ATTRIBUTES               attributes;
+    UNICODE_STRING                  name;
+    HANDLE                          serviceKey;
+    HANDLE                          profilesKey;
+    HANDLE                          profileKey;
+    PKEY_BASIC_INFORMATION          info;
+    ULONG                           infoLength;
+    ULONG                           resultLength;
+    MOUFILTR_SET_TRANSFORM_INPUT    defaults;
+    PMOUFILTER_PROFILE              loaded = NULL;
+    PMOUFILTER_PROFILE              profile;
+    PMOUFILTER_PROFILE *            bucket;
+    ULONG                           buckets;
+    ULONG                           index;
+    NTSTATUS                        status;
+
+    InitializeObjectAttributes(&attributes,
+                               RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwOpenKey(&serviceKey, KEY_READ, &attributes);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    RtlInitUnicodeString(&name, L"Parameters\\Profiles");
+    InitializeObjectAttributes(&attributes,
+                               &name,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               serviceKey,
+                               NULL);
+
+    status = ZwOpenKey(&profilesKey, KEY_READ, &attributes);
+    ZwClose(serviceKey);
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    infoLength = sizeof(KEY_BASIC_INFORMATION) + 256 * sizeof(WCHAR);
+    info = (PKEY_BASIC_INFORMATION) ExAllocatePool(PagedPool, infoLength);
+    if (NULL == info) {
+        ZwClose(profilesKey);
+        return;
+    }
+
+    //
+    // What a profile leaves out comes from the Parameters key
+    //
+    RtlZeroMemory(&defaults, sizeof(defaults));
+    defaults.Version = MOUFILTR_INTERFACE_VERSION;
+    defaults.Flags = MouFilter_Config.Transform.Flags;
+    defaults.ScaleX = MouFilter_Config.Transform.ScaleX;
+    defaults.ScaleY = MouFilter_Config.Transform.ScaleY;
+    defaults.AccelThreshold = MouFilter_Config.Transform.AccelThreshold;
+    defaults.AccelScale = MouFilter_Config.Transform.AccelScale;
+
+    for (index = 0; ; index++) {
+        status = ZwEnumerateKey(profilesKey,
+                                index,
+                                KeyBasicInformation,
+                                info,
+                                infoLength,
+                                &resultLength);
+
+        if (STATUS_NO_MORE_ENTRIES == status) {
+            break;
+        }
+        if (!NT_SUCCESS(status)) {
+            //
+            // A name too long to be one of ours; skip it
+            //
+            continue;
+        }
+
+        name.Buffer = info->Name;
+        name.Length = (USHORT) info->NameLength;
+        name.MaximumLength = (USHORT) info->NameLength;
+
+        InitializeObjectAttributes(&attributes,
+                                   &name,
+                                   OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                                   profilesKey,
+                                   NULL);
+
+        status = ZwOpenKey(&profileKey, KEY_READ, &attributes);
+        if (!NT_SUCCESS(status)) {
+            continue;
+        }
+
+        profile = MouFilter_ProfileRead(profileKey, &defaults);
+        ZwClose(profileKey);
+
+        if (NULL != profile) {
+            profile->Next = loaded;
+            loaded = profile;
+            MouFilter_Profiles.Count++;
+        }
+    }
+
+    ExFreePool(info);
+    ZwClose(profilesKey);
+
+    if (0 == MouFilter_Profiles.Count) {
+        return;
+    }
+
+    //
+    // About one profile per bucket: a power of two no smaller than the
+    // count, so the bucket is the low bits of the hash
+    //
+    for (buckets = 16; buckets < MouFilter_Profiles.Count && buckets < 0x10000; buckets <<= 1) {
+        ;
+    }
+
+    MouFilter_Profiles.Buckets = (PMOUFILTER_PROFILE *)
+        ExAllocatePool(PagedPool, buckets * sizeof(PMOUFILTER_PROFILE));
+
+    if (NULL == MouFilter_Profiles.Buckets) {
+        DbgPrint("MouFilter_ProfileLoad() no memory for the table, profiles ignored\n");
+
+        while (NULL != loaded) {
+            profile = loaded;
+            loaded = profile->Next;
+            ExFreePool(profile);
+        }
+        MouFilter_Profiles.Count = 0;
+        return;
+    }
+
+    RtlZeroMemory(MouFilter_Profiles.Buckets, buckets * sizeof(PMOUFILTER_PROFILE));
+    MouFilter_Profiles.BucketMask = buckets - 1;
+
+    while (NULL != loaded) {
+        profile = loaded;
+        loaded = profile->Next;
+
+        if (0 != profile->HardwareIdLength) {
+            bucket = &MouFilter_Profiles.Buckets[profile->Hash & MouFilter_Profiles.BucketMask];
+        }
+        else {
+            bucket = &MouFilter_Profiles.Identifiers;
+        }
+
+        profile->Next = *bucket;
+        *bucket = profile;
+    }
+
+    DbgPrint("MouFilter_ProfileLoad() %lu profiles in %lu buckets\n",
+             MouFilter_Profiles.Count, buckets);
+}
+
+VOID
+MouFilter_ProfileUnload(
+    VOID
+    )
+/*++
+Routine Description:
+
+    Frees the profiles.  Called from MouFilter_Unload.
+
+--*/
+{
+    PMOUFILTER_PROFILE  profile;
+    ULONG               i;
+
+    PAGED_CODE();
+
+    if (NULL != MouFilter_Profiles.Buckets) {
+        for (i = 0; i <= MouFilter_Profiles.BucketMask; i++) {
+            while (NULL != MouFilter_Profiles.Buckets[i]) {
+                profile = MouFilter_Profiles.Buckets[i];
+                MouFilter_Profiles.Buckets[i] = profile->Next;
+                ExFreePool(profile);
+            }
+        }
+
+        ExFreePool(MouFilter_Profiles.Buckets);
+        MouFilter_Profiles.Buckets = NULL;
+    }
+
+    while (NULL != MouFilter_Profiles.Identifiers) {
+        profile = MouFilter_Profiles.Identifiers;
+        MouFilter_Profiles.Identifiers = profile->Next;
+        ExFreePool(profile);
+    }
+}
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileFind(
+    IN PCWSTR Id,
+    IN ULONG Length
+    )
+{
+    PMOUFILTER_PROFILE  profile;
+    ULONG               hash;
+    ULONG               i;
+
+    PAGED_CODE();
+
+    hash = MouFilter_ProfileHash(Id, Length);
+
+    for (profile = MouFilter_Profiles.Buckets[hash & MouFilter_Profiles.BucketMask];
+         NULL != profile;
+         profile = profile->Next) {
+
+        if (profile->Hash != hash || profile->HardwareIdLength != Length) {
+            continue;
+        }
+
+        for (i = 0; i < Length; i++) {
+            if (profile->HardwareId[i] != RtlUpcaseUnicodeChar(Id[i])) {
+                break;
+            }
+        }
+
+        if (i == Length) {
+            return profile;
+        }
+    }
+
+    return NULL;
+}
+
+PMOUFILTER_PROFILE
+MouFilter_ProfileFindHardwareId(
+    IN PDEVICE_OBJECT PDO
+    )
+/*++
+Routine Description:
+
+    Looks up the hardware IDs of the device, most specific first.  Called
+    from MouFilter_AddDevice.
+
+--*/
+{
+    PMOUFILTER_PROFILE  profile = NULL;
+    PWCHAR              ids;
+    PWCHAR              id;
+    ULONG               idsLength = 0;
+    ULONG               length;
+    NTSTATUS            status;
+
+    PAGED_CODE();
+
+    if (NULL == MouFilter_Profiles.Buckets) {
+        return NULL;
+    }
+
+    status = IoGetDeviceProperty(PDO, DevicePropertyHardwareID, 0, NULL, &idsLength);
+    if (STATUS_BUFFER_TOO_SMALL != status || 0 == idsLength) {
+        return NULL;
+    }
+
+    //
+    // One more WCHAR than asked for, so the list is sure to end in an
+    // empty string
+    //
+    ids = (PWCHAR) ExAllocatePool(PagedPool, idsLength + 2 * sizeof(WCHAR));
+    if (NULL == ids) {
+        return NULL;
+    }
+    RtlZeroMemory(ids, idsLength + 2 * sizeof(WCHAR));
+
+    status = IoGetDeviceProperty(PDO, DevicePropertyHardwareID, idsLength, ids, &idsLength);
+    if (NT_SUCCESS(status)) {
+        for (id = ids; UNICODE_NULL != *id && NULL == profile; id += length + 1) {
+            for (length = 0; UNICODE_NULL != id[length]; length++) {
+                ;
+            }
+
+            profile = MouFilter_ProfileFind(id, length);
+        }
+    }
+
+    ExFreePool(ids);
+
+    return profile;
+}
+
+VOID
+MouFilter_ProfileApplyIdentifier(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG MouseIdentifier
+    )
+/*++
+Routine Description:
+
+    Called from MouFilter_QueryMouseAttributes with what the port driver
+    reported.  Only the first answer counts, so a transform set through the
+    control device is not replaced when the device is restarted.
+
+--*/
+{
+    PMOUFILTER_PROFILE  profile;
+    NTSTATUS            status;
+
+    PAGED_CODE();
+
+    if (DevExt->ProfileResolved) {
+        return;
+    }
+    DevExt->ProfileResolved = TRUE;
+
+    for (profile = MouFilter_Profiles.Identifiers; NULL != profile; profile = profile->Next) {
+        if (profile->MouseIdentifier == MouseIdentifier) {
+            break;
+        }
+    }
+
+    if (NULL == profile) {
+        return;
+    }
+
+    DbgPrint("MouFilter_ProfileApplyIdentifier() instance %lu uses the profile for MouseIdentifier %lu\n",
+             DevExt->InstanceId, MouseIdentifier);
+
+    status = MouFilter_TransformPublishCopy(DevExt, &profile->Transform);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("MouFilter_ProfileApplyIdentifier() could not apply it (0x%08x)\n", status);
+    }
+}
@@ -0,0 +1,285 @@
+/*++
+
+Definitions shared between the filter driver and the user mode programs
+that talk to it through its control device.  This file must build in both
+places, so it only depends on what ntddk.h and windows.h have in common
+(plus ntddmou.h for MOUSE_INPUT_DATA).
+
+File: public.h
+
+--*/
+
+#ifndef MOUFILTR_PUBLIC_H
+#define MOUFILTR_PUBLIC_H
+
+#include <ntddmou.h>
+
+//
+// Class GUID of the control device, used by IoCreateDeviceSecure so an
+// administrator can override its security descriptor in the registry.
+//
+// {2B36C4B3-6531-476C-A315-D1E73E9F3421}
+//
+DEFINE_GUID(GUID_DEVCLASS_MOUFILTR_CONTROL,
+    0x2b36c4b3, 0x6531, 0x476c, 0xa3, 0x15, 0xd1, 0xe7, 0x3e, 0x9f, 0x34, 0x21);
+
+//
+// Names of the control device.  User mode opens "\\.\MouFiltr".
+//
+#define MOUFILTR_CONTROL_DEVICE_NAME_U  L"\\Device\\MouFiltr"
+#define MOUFILTR_DOS_DEVICE_NAME_U      L"\\DosDevices\\MouFiltr"
+#define MOUFILTR_WIN32_DEVICE_NAME      "\\\\.\\MouFiltr"
+
+//
+// Control codes understood by the control device.  Every input structure
+// starts with the version of this header it was built against.
+//
+#define MOUFILTR_INTERFACE_VERSION      1
+
+#define IOCTL_MOUFILTR_MAP_TAP      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_UNMAP_TAP    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_READ_BATCH   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_OUT_DIRECT, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_SET_TRANSFORM CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define IOCTL_MOUFILTR_ENUM_INSTANCES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_OUT_DIRECT, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_GET_STATS    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_GET_TRANSFORM CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_DATA)
+#define IOCTL_MOUFILTR_GET_HISTOGRAM CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_READ_DATA)
+
+//
+// Packet tap
+//
+// Each filter instance can publish every packet it sees into a ring of
+// MOUFILTR_TAP_RECORDs that is mapped once into the address space of every
+// consumer.  There is a single producer (the filter's service callback) and
+// any number of consumers; consumers never write anything the filter reads
+// back except WakeRequested, so a slow or broken consumer cannot stall input.
+//
+// To read the ring, a consumer keeps its own count of records consumed
+// (Tail, starting at Head when it maps the ring) and:
+//
+//   1. reads Head (the filter stores it with release semantics after the
+//      records it covers are written)
+//   2. if Head - Tail > RecordCount, the records in between were
+//      overwritten; count them as lost and move Tail up to
+//      Head - RecordCount
+//   3. copies records Tail .. Head-1 out of Records[index & (RecordCount-1)]
+//   4. reads WriteHead: any copied record with an index below
+//      (WriteHead - RecordCount) may have been overwritten while it was
+//      being copied and must be discarded
+//
+// The filter raises WriteHead before it touches any record slot and raises
+// Head once those slots are complete, so WriteHead is never behind Head.
+//
+// Head and Tail are free running ULONGs and all the arithmetic above is
+// done modulo 2^32.
+//
+// A consumer that would rather sleep than poll passes an event handle when
+// it maps the ring, sets WakeRequested to 1, checks Head once more, and
+// then waits.  The filter signals every registered event the next time it
+// publishes and finds WakeRequested set.
+//
+
+#define MOUFILTR_TAP_HEADER_SIZE    64
+
+typedef struct _MOUFILTR_TAP_HEADER
+{
+    ULONG           Version;        // MOUFILTR_INTERFACE_VERSION
+    ULONG           HeaderSize;     // offset of the first record
+    ULONG           RecordSize;     // sizeof(MOUFILTR_TAP_RECORD)
+    ULONG           RecordCount;    // always a power of two
+    volatile ULONG  Head;           // records published so far
+    volatile ULONG  WriteHead;      // records the filter has started writing
+    volatile LONG   WakeRequested;  // set by a consumer before it waits
+    ULONG           InstanceId;     // filter instance that owns the ring
+    ULONG           Reserved[8];
+} MOUFILTR_TAP_HEADER, *PMOUFILTR_TAP_HEADER;
+
+typedef struct _MOUFILTR_TAP_RECORD
+{
+    ULONGLONG           Timestamp;  // interrupt time, 100ns units, spread
+                                    // over the batch at PacketInterval
+    MOUSE_INPUT_DATA    Data;       // the packet as the filter received it
+} MOUFILTR_TAP_RECORD, *PMOUFILTR_TAP_RECORD;
+
+typedef struct _MOUFILTR_MAP_TAP_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       InstanceId;         // filter instance to tap
+    ULONGLONG   EventHandle;        // optional event to signal, or 0
+} MOUFILTR_MAP_TAP_INPUT, *PMOUFILTR_MAP_TAP_INPUT;
+
+typedef struct _MOUFILTR_MAP_TAP_OUTPUT
+{
+    ULONGLONG   Address;            // user address of the MOUFILTR_TAP_HEADER
+    ULONG       Size;               // bytes mapped
+    ULONG       Reserved;
+} MOUFILTR_MAP_TAP_OUTPUT, *PMOUFILTR_MAP_TAP_OUTPUT;
+
+typedef struct _MOUFILTR_UNMAP_TAP_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       InstanceId;         // filter instance mapped earlier
+} MOUFILTR_UNMAP_TAP_INPUT, *PMOUFILTR_UNMAP_TAP_INPUT;
+
+//
+// Batched reads
+//
+// IOCTL_MOUFILTR_READ_BATCH is an "inverted call": the request stays
+// pending in the filter until enough packets have arrived to be worth an
+// IRP completion, then comes back with as many packets as fit in the output
+// buffer.  Keep a few of them outstanding to never miss a packet.
+//
+// The filter completes the oldest pending request once MinimumCount packets
+// are waiting, or TimeoutMs after the first waiting packet arrived, whichever
+// comes first.  Both are per filter instance; the most recent request sets
+// them, and 0 picks the default.  Packets that arrive while the filter's
+// buffer is full are dropped and counted in Lost of the next batch.
+//
+// The output buffer is a MOUFILTR_BATCH_HEADER followed by Count
+// MOUSE_INPUT_DATA records.
+//
+#define MOUFILTR_BATCH_DEFAULT_MINIMUM  128
+#define MOUFILTR_BATCH_DEFAULT_TIMEOUT  20      // milliseconds
+#define MOUFILTR_BATCH_MAXIMUM_TIMEOUT  1000    // milliseconds
+
+typedef struct _MOUFILTR_READ_BATCH_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       InstanceId;         // filter instance to read from
+    ULONG       MinimumCount;       // packets to wait for, or 0
+    ULONG       TimeoutMs;          // longest a packet waits, or 0
+} MOUFILTR_READ_BATCH_INPUT, *PMOUFILTR_READ_BATCH_INPUT;
+
+typedef struct _MOUFILTR_BATCH_HEADER
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       Count;              // records following this header
+    ULONG       Lost;               // packets dropped since the last batch
+    ULONG       Reserved;
+} MOUFILTR_BATCH_HEADER, *PMOUFILTR_BATCH_HEADER;
+
+//
+// Transform
+//
+// IOCTL_MOUFILTR_SET_TRANSFORM changes what one filter instance does to
+// relative movement before the class driver sees it, taking effect with the
+// next packet; input is never paused.  Absolute movement is left alone.
+//
+// Scales are fixed point, in 1/MOUFILTR_SCALE_ONE units: MOUFILTR_SCALE_ONE
+// leaves an axis as it is, 10 * MOUFILTR_SCALE_ONE is what the scalefast
+// sample does, and a negative scale inverts the axis.  Swapping the axes
+// (what the invertaxis sample does) happens before scaling.  When either
+// axis of a packet moves more than AccelThreshold counts, both scales are
+// further multiplied by AccelScale (also in 1/MOUFILTR_SCALE_ONE units).
+//
+#define MOUFILTR_SCALE_ONE              256
+#define MOUFILTR_SCALE_MAXIMUM          (64 * MOUFILTR_SCALE_ONE)
+
+#define MOUFILTR_TRANSFORM_SWAP_AXES    0x00000001
+#define MOUFILTR_TRANSFORM_VALID_FLAGS  MOUFILTR_TRANSFORM_SWAP_AXES
+
+typedef struct _MOUFILTR_SET_TRANSFORM_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       InstanceId;         // filter instance to change
+    ULONG       Flags;              // MOUFILTR_TRANSFORM_XXX
+    LONG        ScaleX;
+    LONG        ScaleY;
+    ULONG       AccelThreshold;     // counts per packet, or 0 for none
+    LONG        AccelScale;         // ignored if AccelThreshold is 0
+    ULONG       Reserved;
+} MOUFILTR_SET_TRANSFORM_INPUT, *PMOUFILTR_SET_TRANSFORM_INPUT;
+
+//
+// IOCTL_MOUFILTR_GET_TRANSFORM takes a MOUFILTR_INSTANCE_INPUT and returns
+// the instance's current transform in the layout above.
+//
+
+//
+// Instances and statistics
+//
+// IOCTL_MOUFILTR_ENUM_INSTANCES returns a MOUFILTR_INSTANCE_LIST followed
+// by one MOUFILTR_INSTANCE_INFO for every filter instance that fits in the
+// output buffer; Count says how many there are in all, so a caller whose
+// buffer was too small can retry with a bigger one.
+//
+// IOCTL_MOUFILTR_GET_STATS takes a MOUFILTR_INSTANCE_INPUT and returns the
+// MOUFILTR_STATS of that instance alone.
+//
+// The counters are 32 bits wide and wrap around.  Size tells how much of
+// MOUFILTR_STATS the driver filled in, so fields can be added at the end.
+//
+typedef struct _MOUFILTR_INSTANCE_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       InstanceId;
+} MOUFILTR_INSTANCE_INPUT, *PMOUFILTR_INSTANCE_INPUT;
+
+typedef struct _MOUFILTR_ENUM_INSTANCES_INPUT
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       Reserved;
+} MOUFILTR_ENUM_INSTANCES_INPUT, *PMOUFILTR_ENUM_INSTANCES_INPUT;
+
+typedef struct _MOUFILTR_STATS
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       Size;               // sizeof(MOUFILTR_STATS)
+    ULONG       Callbacks;          // service callbacks from the port driver
+    ULONG       Packets;            // packets in them
+    ULONG       PacketsDropped;     // reported with no class driver to take them
+    ULONG       AttributeQueriesCached;     // answered by the filter
+    ULONG       AttributeQueriesForwarded;  // sent down the stack
+    ULONG       Connects;           // IOCTL_INTERNAL_MOUSE_CONNECT
+    ULONG       Disconnects;        // IOCTL_INTERNAL_MOUSE_DISCONNECT
+    ULONG       ClassServiceCalls;  // calls into the class driver with packets
+    ULONG       PacketInterval;     // measured time between packets, 100ns units
+    ULONG       Reserved[5];
+} MOUFILTR_STATS, *PMOUFILTR_STATS;
+
+#define MOUFILTR_INSTANCE_STARTED       0x00000001
+#define MOUFILTR_INSTANCE_CONNECTED     0x00000002  // a class driver is connected
+#define MOUFILTR_INSTANCE_TAPPED        0x00000004  // the packet tap exists
+#define MOUFILTR_INSTANCE_BATCHING      0x00000008  // batched reads have been used
+#define MOUFILTR_INSTANCE_TRANSFORMED   0x00000010  // a transform is set
+#define MOUFILTR_INSTANCE_OPEN          0x00000020  // the class driver has the mouse open
+
+typedef struct _MOUFILTR_INSTANCE_INFO
+{
+    ULONG           InstanceId;
+    ULONG           Flags;          // MOUFILTR_INSTANCE_XXX
+    MOUFILTR_STATS  Stats;
+} MOUFILTR_INSTANCE_INFO, *PMOUFILTR_INSTANCE_INFO;
+
+typedef struct _MOUFILTR_INSTANCE_LIST
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       Count;              // filter instances there are
+    ULONG       Returned;           // MOUFILTR_INSTANCE_INFOs that follow
+    ULONG       Reserved;
+} MOUFILTR_INSTANCE_LIST, *PMOUFILTR_INSTANCE_LIST;
+
+//
+// Histograms
+//
+// IOCTL_MOUFILTR_GET_HISTOGRAM takes a MOUFILTR_INSTANCE_INPUT and returns
+// how the port driver has been calling that instance since the mouse was
+// last opened: BatchSize[i] counts service callbacks that brought 2^i to
+// 2^(i+1) - 1 packets, Interval[i] those that came 2^i to 2^(i+1) - 1
+// microseconds after the one before.  The last bucket of each also counts
+// anything larger.  The histograms only exist while the mouse is open;
+// otherwise Open is 0 and every bucket is 0.
+//
+#define MOUFILTR_HISTOGRAM_BUCKETS      16
+
+typedef struct _MOUFILTR_HISTOGRAM
+{
+    ULONG       Version;            // MOUFILTR_INTERFACE_VERSION
+    ULONG       Size;               // sizeof(MOUFILTR_HISTOGRAM)
+    ULONG       InstanceId;
+    ULONG       Open;
+    ULONG       BatchSize[MOUFILTR_HISTOGRAM_BUCKETS];
+    ULONG       Interval[MOUFILTR_HISTOGRAM_BUCKETS];
+} MOUFILTR_HISTOGRAM, *PMOUFILTR_HISTOGRAM;
+
+#endif  // MOUFILTR_PUBLIC_H
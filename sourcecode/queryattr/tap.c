@@ -0,0 +1,488 @@
+/*++
+
+The packet tap: a ring of every packet a filter instance sees, kept in
+nonpaged memory that is mapped once into each consumer's address space.
+Consumers read it directly, so reporting packets to them costs no IRPs at
+all; see public.h for the protocol they follow.
+
+File: tap.c
+
+--*/
+
+#include "moufiltr.h"
+
+NTSTATUS
+MouFilter_TapCreate (
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+PMOUFILTER_TAP_MAPPING
+MouFilter_TapFindMappingLocked (
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN ULONG InstanceId
+    );
+
+VOID
+MouFilter_TapUnmapOneLocked (
+    IN PMOUFILTER_TAP_MAPPING Mapping
+    );
+
+BOOLEAN
+MouFilter_TapAddWaiter (
+    IN PMOUFILTER_TAP Tap,
+    IN PKEVENT Event,
+    OUT PULONG Slot
+    );
+
+VOID
+MouFilter_TapRemoveWaiter (
+    IN PMOUFILTER_TAP Tap,
+    IN ULONG Slot
+    );
+
+//
+// MouFilter_TapPublish runs in the service callback at DISPATCH_LEVEL, and
+// the waiter routines hold a spin lock, so those stay in nonpaged code
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_TapCreate)
+#pragma alloc_text (PAGE, MouFilter_TapRelease)
+#pragma alloc_text (PAGE, MouFilter_TapMap)
+#pragma alloc_text (PAGE, MouFilter_TapUnmap)
+#pragma alloc_text (PAGE, MouFilter_TapUnmapAll)
+#pragma alloc_text (PAGE, MouFilter_TapFindMappingLocked)
+#pragma alloc_text (PAGE, MouFilter_TapUnmapOneLocked)
+#endif
+
+C_ASSERT(sizeof(MOUFILTR_TAP_HEADER) == MOUFILTR_TAP_HEADER_SIZE);
+C_ASSERT(0 == (MOUFILTER_TAP_RECORDS & (MOUFILTER_TAP_RECORDS - 1)));
+
+VOID
+MouFilter_TapPublish(
+    IN PMOUFILTER_TAP Tap,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd,
+    IN ULONGLONG Timestamp,
+    IN ULONG Spacing
+    )
+/*++
+Routine Description:
+
+    Copies a batch of packets into the ring and publishes them.  Called
+    from MouFilter_ServiceCallback at DISPATCH_LEVEL.  Timestamp is the
+    time of the last packet and Spacing the time between packets (see
+    clock.c).
+
+    There is exactly one producer per ring: the port drivers never report
+    packets for one device from two processors at once (mouhid has a single
+    read outstanding, i8042prt reports from its DPC), so Tap->Head needs
+    no lock.
+
+--*/
+{
+    PMOUSE_INPUT_DATA       pCursor;
+    PMOUFILTR_TAP_RECORD    record;
+    ULONG                   head;
+    ULONG                   i;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    head = Tap->Head + (ULONG) (InputDataEnd - InputDataStart);
+
+    //
+    // Only the newest MOUFILTER_TAP_RECORDS packets of a batch can land in
+    // the ring anyway
+    //
+    if (InputDataEnd - InputDataStart > MOUFILTER_TAP_RECORDS) {
+        Tap->Head = head - MOUFILTER_TAP_RECORDS;
+        InputDataStart = InputDataEnd - MOUFILTER_TAP_RECORDS;
+    }
+
+    //
+    // Tell consumers which slots are about to change before changing them.
+    // The interlocked operation also keeps the record stores from moving
+    // ahead of it.
+    //
+    InterlockedExchange((PLONG) &Tap->Header->WriteHead, (LONG) head);
+
+    for (pCursor = InputDataStart, i = Tap->Head; pCursor < InputDataEnd; pCursor++, i++) {
+        record = &Tap->Records[i & (MOUFILTER_TAP_RECORDS - 1)];
+        record->Timestamp = Timestamp - (ULONGLONG) (InputDataEnd - 1 - pCursor) * Spacing;
+        record->Data = *pCursor;
+    }
+
+    //
+    // Release the new records to the consumers
+    //
+    Tap->Head = head;
+    InterlockedExchange((PLONG) &Tap->Header->Head, (LONG) head);
+
+    //
+    // Waking anyone costs a spin lock, so only do it when a consumer has
+    // said it is about to sleep
+    //
+    if (0 != Tap->Header->WakeRequested &&
+        0 != InterlockedExchange(&Tap->Header->WakeRequested, 0)) {
+
+        KeAcquireSpinLockAtDpcLevel(&Tap->WaiterLock);
+        for (i = 0; i < MOUFILTER_TAP_MAX_WAITERS; i++) {
+            if (NULL != Tap->Waiters[i]) {
+                KeSetEvent(Tap->Waiters[i], IO_MOUSE_INCREMENT, FALSE);
+            }
+        }
+        KeReleaseSpinLockFromDpcLevel(&Tap->WaiterLock);
+    }
+}
+
+BOOLEAN
+MouFilter_TapAddWaiter(
+    IN PMOUFILTER_TAP Tap,
+    IN PKEVENT Event,
+    OUT PULONG Slot
+    )
+{
+    KIRQL   oldIrql;
+    ULONG   i;
+    BOOLEAN added = FALSE;
+
+    KeAcquireSpinLock(&Tap->WaiterLock, &oldIrql);
+    for (i = 0; i < MOUFILTER_TAP_MAX_WAITERS; i++) {
+        if (NULL == Tap->Waiters[i]) {
+            Tap->Waiters[i] = Event;
+            *Slot = i;
+            added = TRUE;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&Tap->WaiterLock, oldIrql);
+
+    return added;
+}
+
+VOID
+MouFilter_TapRemoveWaiter(
+    IN PMOUFILTER_TAP Tap,
+    IN ULONG Slot
+    )
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Tap->WaiterLock, &oldIrql);
+    Tap->Waiters[Slot] = NULL;
+    KeReleaseSpinLock(&Tap->WaiterLock, oldIrql);
+}
+
+NTSTATUS
+MouFilter_TapCreate(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Allocates the ring for a filter device the first time someone maps it.
+    The caller holds the global lock.
+
+--*/
+{
+    PMOUFILTER_TAP  tap;
+    PUCHAR          buffer;
+    ULONG           size;
+
+    PAGED_CODE();
+
+    size = (ULONG) ROUND_TO_PAGES(MOUFILTR_TAP_HEADER_SIZE +
+                                  MOUFILTER_TAP_RECORDS * sizeof(MOUFILTR_TAP_RECORD));
+
+    tap = (PMOUFILTER_TAP) ExAllocatePool(NonPagedPool, sizeof(MOUFILTER_TAP));
+    if (NULL == tap) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(tap, sizeof(MOUFILTER_TAP));
+
+    //
+    // Anything a page or larger comes back page aligned, so the header
+    // starts at the beginning of the user mapping.  That is why this one
+    // skips the checked-build guard in pool.c.
+    //
+    buffer = (PUCHAR) ExAllocatePoolWithTag(NonPagedPool, size, MOUFILTER_POOL_TAG);
+    if (NULL == buffer) {
+        ExFreePool(tap);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(buffer, size);
+
+    tap->Mdl = IoAllocateMdl(buffer, size, FALSE, FALSE, NULL);
+    if (NULL == tap->Mdl) {
+        ExFreePoolWithTag(buffer, MOUFILTER_POOL_TAG);
+        ExFreePool(tap);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(tap->Mdl);
+
+    tap->Header = (PMOUFILTR_TAP_HEADER) buffer;
+    tap->Records = (PMOUFILTR_TAP_RECORD) (buffer + MOUFILTR_TAP_HEADER_SIZE);
+    tap->Size = size;
+    tap->RefCount = 1;
+    KeInitializeSpinLock(&tap->WaiterLock);
+
+    tap->Header->Version = MOUFILTR_INTERFACE_VERSION;
+    tap->Header->HeaderSize = MOUFILTR_TAP_HEADER_SIZE;
+    tap->Header->RecordSize = sizeof(MOUFILTR_TAP_RECORD);
+    tap->Header->RecordCount = MOUFILTER_TAP_RECORDS;
+    tap->Header->InstanceId = DevExt->InstanceId;
+
+    //
+    // The service callback picks this up without taking any lock
+    //
+    InterlockedExchangePointer((PVOID *) &DevExt->Tap, tap);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MouFilter_TapRelease(
+    IN PMOUFILTER_TAP Tap
+    )
+{
+    PAGED_CODE();
+
+    if (0 == InterlockedDecrement(&Tap->RefCount)) {
+        IoFreeMdl(Tap->Mdl);
+        ExFreePoolWithTag(Tap->Header, MOUFILTER_POOL_TAG);
+        ExFreePool(Tap);
+    }
+}
+
+PMOUFILTER_TAP_MAPPING
+MouFilter_TapFindMappingLocked(
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN ULONG InstanceId
+    )
+{
+    PLIST_ENTRY             entry;
+    PMOUFILTER_TAP_MAPPING  mapping;
+
+    PAGED_CODE();
+
+    for (entry = FileContext->Mappings.Flink;
+         entry != &FileContext->Mappings;
+         entry = entry->Flink) {
+
+        mapping = CONTAINING_RECORD(entry, MOUFILTER_TAP_MAPPING, ListEntry);
+        if (mapping->InstanceId == InstanceId) {
+            return mapping;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+MouFilter_TapMap(
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN PMOUFILTR_MAP_TAP_INPUT Input,
+    IN KPROCESSOR_MODE RequestorMode,
+    OUT PMOUFILTR_MAP_TAP_OUTPUT Output
+    )
+/*++
+Routine Description:
+
+    Maps the tap of one filter instance into the calling process.  Runs at
+    PASSIVE_LEVEL in the context of the process that sent the IOCTL, which
+    is the only place a user mode mapping can be made.
+
+--*/
+{
+    PMOUFILTER_TAP_MAPPING  mapping;
+    PDEVICE_EXTENSION       devExt;
+    PKEVENT                 event = NULL;
+    PVOID                   userAddress;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    if (0 != Input->EventHandle) {
+        status = ObReferenceObjectByHandle((HANDLE) (ULONG_PTR) Input->EventHandle,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           RequestorMode,
+                                           (PVOID *) &event,
+                                           NULL);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    mapping = (PMOUFILTER_TAP_MAPPING)
+        ExAllocatePool(PagedPool, sizeof(MOUFILTER_TAP_MAPPING));
+    if (NULL == mapping) {
+        if (NULL != event) {
+            ObDereferenceObject(event);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(mapping, sizeof(MOUFILTER_TAP_MAPPING));
+
+    MouFilter_AcquireGlobalLock();
+
+    //
+    // One mapping per instance per handle
+    //
+    if (NULL != MouFilter_TapFindMappingLocked(FileContext, Input->InstanceId)) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    devExt = MouFilter_FindDeviceLocked(Input->InstanceId);
+    if (NULL == devExt) {
+        status = STATUS_NO_SUCH_DEVICE;
+        goto Exit;
+    }
+
+    if (NULL == devExt->Tap) {
+        status = MouFilter_TapCreate(devExt);
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+    }
+
+    //
+    // MmMapLockedPagesSpecifyCache raises an exception instead of returning
+    // NULL when it cannot map into user space
+    //
+    __try {
+        userAddress = MmMapLockedPagesSpecifyCache(devExt->Tap->Mdl,
+                                                   UserMode,
+                                                   MmCached,
+                                                   NULL,
+                                                   FALSE,
+                                                   NormalPagePriority);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        userAddress = NULL;
+    }
+
+    if (NULL == userAddress) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    if (NULL != event &&
+        !MouFilter_TapAddWaiter(devExt->Tap, event, &mapping->WaiterSlot)) {
+        MmUnmapLockedPages(userAddress, devExt->Tap->Mdl);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    InterlockedIncrement(&devExt->Tap->RefCount);
+
+    mapping->InstanceId = Input->InstanceId;
+    mapping->Tap = devExt->Tap;
+    mapping->UserAddress = userAddress;
+    mapping->Process = IoGetCurrentProcess();
+    ObReferenceObject(mapping->Process);
+    mapping->Event = event;
+    InsertTailList(&FileContext->Mappings, &mapping->ListEntry);
+
+    Output->Address = (ULONGLONG) (ULONG_PTR) userAddress;
+    Output->Size = devExt->Tap->Size;
+
+Exit:
+    MouFilter_ReleaseGlobalLock();
+
+    if (!NT_SUCCESS(status)) {
+        if (NULL != event) {
+            ObDereferenceObject(event);
+        }
+        ExFreePool(mapping);
+    }
+
+    return status;
+}
+
+VOID
+MouFilter_TapUnmapOneLocked(
+    IN PMOUFILTER_TAP_MAPPING Mapping
+    )
+{
+    KAPC_STATE  apcState;
+    BOOLEAN     attached = FALSE;
+
+    PAGED_CODE();
+
+    if (NULL != Mapping->Event) {
+        MouFilter_TapRemoveWaiter(Mapping->Tap, Mapping->WaiterSlot);
+        ObDereferenceObject(Mapping->Event);
+    }
+
+    //
+    // A user mode mapping can only be undone in the process it was made
+    // in.  IOCTL_MOUFILTR_UNMAP_TAP refuses other processes, but the last
+    // handle can be closed from anywhere once it has been duplicated or
+    // inherited.
+    //
+    if (Mapping->Process != IoGetCurrentProcess()) {
+        KeStackAttachProcess((PRKPROCESS) Mapping->Process, &apcState);
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages(Mapping->UserAddress, Mapping->Tap->Mdl);
+
+    if (attached) {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(Mapping->Process);
+    MouFilter_TapRelease(Mapping->Tap);
+
+    RemoveEntryList(&Mapping->ListEntry);
+    ExFreePool(Mapping);
+}
+
+NTSTATUS
+MouFilter_TapUnmap(
+    IN PMOUFILTER_FILE_CONTEXT FileContext,
+    IN ULONG InstanceId
+    )
+{
+    PMOUFILTER_TAP_MAPPING  mapping;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    MouFilter_AcquireGlobalLock();
+
+    mapping = MouFilter_TapFindMappingLocked(FileContext, InstanceId);
+    if (NULL == mapping) {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else if (mapping->Process != IoGetCurrentProcess()) {
+        //
+        // The address means nothing in this process
+        //
+        status = STATUS_ACCESS_DENIED;
+    }
+    else {
+        MouFilter_TapUnmapOneLocked(mapping);
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    return status;
+}
+
+VOID
+MouFilter_TapUnmapAll(
+    IN PMOUFILTER_FILE_CONTEXT FileContext
+    )
+{
+    PAGED_CODE();
+
+    MouFilter_AcquireGlobalLock();
+
+    while (!IsListEmpty(&FileContext->Mappings)) {
+        MouFilter_TapUnmapOneLocked(
+            CONTAINING_RECORD(FileContext->Mappings.Flink, MOUFILTER_TAP_MAPPING, ListEntry));
+    }
+
+    MouFilter_ReleaseGlobalLock();
+}
@@ -0,0 +1,345 @@
+/*++
+
+The transform: what a filter instance does to relative movement before the
+class driver sees it (scaling, swapping the axes, acceleration), as set at
+run time through IOCTL_MOUFILTR_SET_TRANSFORM, or from the start through
+the registry (see config.c).
+
+Each setting is turned into an immutable MOUFILTER_TRANSFORM, with the
+acceleration already folded into the scales, and published with one pointer
+exchange.  MouFilter_ServiceCallback reads the pointer without a lock inside
+its grace period section, so input never pauses while settings change, and
+the old transform is freed once the grace period is over (see grace.c).
+
+File: transform.c
+
+--*/
+
+#include "moufiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, MouFilter_TransformCompile)
+#pragma alloc_text (PAGE, MouFilter_TransformIsIdentity)
+#pragma alloc_text (PAGE, MouFilter_TransformSet)
+#pragma alloc_text (PAGE, MouFilter_TransformPublish)
+#pragma alloc_text (PAGE, MouFilter_TransformPublishCopy)
+#pragma alloc_text (PAGE, MouFilter_TransformGet)
+#endif
+
+LONG
+MouFilter_TransformScale(
+    IN LONG Value,
+    IN LONG Scale,
+    IN OUT PLONG Remainder
+    )
+/*++
+Routine Description:
+
+    Value * Scale / MOUFILTR_SCALE_ONE, carrying the fraction over to the
+    next packet so slow movement is not lost when scaling down.
+
+--*/
+{
+    LONGLONG    scaled;
+    LONG        result;
+
+    scaled = (LONGLONG) Value * Scale + *Remainder;
+    result = (LONG) (scaled / MOUFILTR_SCALE_ONE);
+    *Remainder = (LONG) (scaled - (LONGLONG) result * MOUFILTR_SCALE_ONE);
+
+    return result;
+}
+
+VOID
+MouFilter_TransformApply(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Transform,
+    IN PMOUSE_INPUT_DATA InputDataStart,
+    IN PMOUSE_INPUT_DATA InputDataEnd
+    )
+/*++
+Routine Description:
+
+    Rewrites the relative movement of each packet in place, inside a
+    grace period section.  Called either from the service callback at
+    DISPATCH_LEVEL or, when offloading, from the offload thread at
+    PASSIVE_LEVEL (see offload.c).  The two never overlap, so whichever
+    one it is is the only writer of DevExt->TransformRemainder: the thread
+    only starts on the ring once no callback is left on the inline path,
+    and after the last close the callback only goes back to it once the
+    thread has exited (see activity.c).
+
+--*/
+{
+    PMOUSE_INPUT_DATA   packet;
+    LONG                x;
+    LONG                y;
+    LONG                scaleX;
+    LONG                scaleY;
+
+    for (packet = InputDataStart; packet < InputDataEnd; packet++) {
+        if (packet->Flags & (MOUSE_MOVE_ABSOLUTE | MOUSE_ATTRIBUTES_CHANGED)) {
+            continue;
+        }
+
+        x = packet->LastX;
+        y = packet->LastY;
+
+        if (Transform->Flags & MOUFILTR_TRANSFORM_SWAP_AXES) {
+            x = packet->LastY;
+            y = packet->LastX;
+        }
+
+        scaleX = Transform->ScaleX;
+        scaleY = Transform->ScaleY;
+
+        if (0 != Transform->AccelThreshold &&
+            ((ULONG) (x < 0 ? -x : x) > Transform->AccelThreshold ||
+             (ULONG) (y < 0 ? -y : y) > Transform->AccelThreshold)) {
+            scaleX = Transform->AccelScaleX;
+            scaleY = Transform->AccelScaleY;
+        }
+
+        packet->LastX = MouFilter_TransformScale(x, scaleX, &DevExt->TransformRemainder[0]);
+        packet->LastY = MouFilter_TransformScale(y, scaleY, &DevExt->TransformRemainder[1]);
+    }
+}
+
+NTSTATUS
+MouFilter_TransformPublish(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Transform
+    )
+/*++
+Routine Description:
+
+    Makes Transform (or no transform at all, if NULL) the one the service
+    callback uses, and frees the previous one once no callback can still be
+    using it.  Takes ownership of Transform.
+
+--*/
+{
+    PMOUFILTER_TRANSFORM    old;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&DevExt->PublishLock);
+
+    old = InterlockedExchangePointer((PVOID *) &DevExt->Transform, Transform);
+    if (NULL != old) {
+        MouFilter_GraceWait(&DevExt->Grace);
+    }
+
+    ExReleaseFastMutex(&DevExt->PublishLock);
+
+    if (NULL != old) {
+        MouFilter_SnapshotFree(old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MouFilter_TransformPublishCopy(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PMOUFILTER_TRANSFORM Compiled
+    )
+/*++
+Routine Description:
+
+    Publishes a copy of a transform that lives on elsewhere (the
+    configuration, or a profile).
+
+--*/
+{
+    PMOUFILTER_TRANSFORM    transform = NULL;
+
+    PAGED_CODE();
+
+    if (!MouFilter_TransformIsIdentity(Compiled)) {
+        transform = (PMOUFILTER_TRANSFORM) MouFilter_SnapshotAllocate();
+        if (NULL == transform) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        *transform = *Compiled;
+    }
+
+    return MouFilter_TransformPublish(DevExt, transform);
+}
+
+NTSTATUS
+MouFilter_TransformCompile(
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Input,
+    OUT PMOUFILTER_TRANSFORM Transform
+    )
+/*++
+Routine Description:
+
+    Checks a transform as user mode or the registry gives it and works out
+    everything the service callback needs, so all it does per packet is
+    two multiplications.
+
+--*/
+{
+    LONG    accelScale;
+
+    PAGED_CODE();
+
+    if (0 != (Input->Flags & ~MOUFILTR_TRANSFORM_VALID_FLAGS) ||
+        Input->ScaleX < -MOUFILTR_SCALE_MAXIMUM || Input->ScaleX > MOUFILTR_SCALE_MAXIMUM ||
+        Input->ScaleY < -MOUFILTR_SCALE_MAXIMUM || Input->ScaleY > MOUFILTR_SCALE_MAXIMUM) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    accelScale = MOUFILTR_SCALE_ONE;
+    if (0 != Input->AccelThreshold) {
+        accelScale = Input->AccelScale;
+        if (accelScale < 0 || accelScale > MOUFILTR_SCALE_MAXIMUM) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    Transform->Flags = Input->Flags;
+    Transform->ScaleX = Input->ScaleX;
+    Transform->ScaleY = Input->ScaleY;
+    Transform->AccelThreshold = Input->AccelThreshold;
+    Transform->AccelScale = accelScale;
+    Transform->AccelScaleX = (LONG) ((LONGLONG) Input->ScaleX * accelScale / MOUFILTR_SCALE_ONE);
+    Transform->AccelScaleY = (LONG) ((LONGLONG) Input->ScaleY * accelScale / MOUFILTR_SCALE_ONE);
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+MouFilter_TransformIsIdentity(
+    IN PMOUFILTER_TRANSFORM Transform
+    )
+/*++
+Routine Description:
+
+    The identity transform is published as no transform at all, which
+    keeps the callback from touching the packets.
+
+--*/
+{
+    PAGED_CODE();
+
+    return (BOOLEAN) (0 == Transform->Flags &&
+                      MOUFILTR_SCALE_ONE == Transform->ScaleX &&
+                      MOUFILTR_SCALE_ONE == Transform->ScaleY &&
+                      MOUFILTR_SCALE_ONE == Transform->AccelScale);
+}
+
+NTSTATUS
+MouFilter_TransformSet(
+    IN PMOUFILTR_SET_TRANSFORM_INPUT Input
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_MOUFILTR_SET_TRANSFORM at PASSIVE_LEVEL.
+
+--*/
+{
+    PDEVICE_EXTENSION       devExt;
+    PMOUFILTER_TRANSFORM    transform = NULL;
+    MOUFILTER_TRANSFORM     compiled;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    status = MouFilter_TransformCompile(Input, &compiled);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (!MouFilter_TransformIsIdentity(&compiled)) {
+        transform = (PMOUFILTER_TRANSFORM) MouFilter_SnapshotAllocate();
+        if (NULL == transform) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        *transform = compiled;
+    }
+
+    //
+    // The global lock keeps the instance from being removed meanwhile;
+    // removal publishes NULL after taking it
+    //
+    MouFilter_AcquireGlobalLock();
+
+    devExt = MouFilter_FindDeviceLocked(Input->InstanceId);
+    if (NULL == devExt) {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else {
+        status = MouFilter_TransformPublish(devExt, transform);
+        transform = NULL;
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    if (NULL != transform) {
+        MouFilter_SnapshotFree(transform);
+    }
+
+    return status;
+}
+
+NTSTATUS
+MouFilter_TransformGet(
+    IN ULONG InstanceId,
+    OUT PMOUFILTR_SET_TRANSFORM_INPUT Output
+    )
+/*++
+Routine Description:
+
+    Handles IOCTL_MOUFILTR_GET_TRANSFORM: reports the transform an instance
+    uses, in the layout IOCTL_MOUFILTR_SET_TRANSFORM takes it.
+
+--*/
+{
+    PDEVICE_EXTENSION       devExt;
+    PMOUFILTER_TRANSFORM    transform;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Output, sizeof(MOUFILTR_SET_TRANSFORM_INPUT));
+    Output->Version = MOUFILTR_INTERFACE_VERSION;
+    Output->InstanceId = InstanceId;
+
+    MouFilter_AcquireGlobalLock();
+
+    devExt = MouFilter_FindDeviceLocked(InstanceId);
+    if (NULL == devExt) {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else {
+        //
+        // Holding the publish lock keeps the transform from being freed
+        // while we look at it
+        //
+        ExAcquireFastMutex(&devExt->PublishLock);
+
+        transform = devExt->Transform;
+        if (NULL != transform) {
+            Output->Flags = transform->Flags;
+            Output->ScaleX = transform->ScaleX;
+            Output->ScaleY = transform->ScaleY;
+            Output->AccelThreshold = transform->AccelThreshold;
+            Output->AccelScale = transform->AccelScale;
+        }
+        else {
+            Output->ScaleX = MOUFILTR_SCALE_ONE;
+            Output->ScaleY = MOUFILTR_SCALE_ONE;
+        }
+
+        ExReleaseFastMutex(&devExt->PublishLock);
+    }
+
+    MouFilter_ReleaseGlobalLock();
+
+    return status;
+}